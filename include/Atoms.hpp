@@ -69,6 +69,18 @@ public:
      * @note 戻り値は0次元のtorch::Tensorです。
      */
     const torch::Tensor& size() const { return n_atoms_; }
+    /**
+     * @brief 固定されていない原子の数を取得
+     * @return 可動原子の数（自由度の計算に用います）
+     * @note 戻り値は0次元のtorch::Tensorです。
+     */
+    const torch::Tensor& num_mobile() const { return frozen_.defined() ? n_mobile_ : n_atoms_; }
+    /**
+     * @brief 固定原子を取得
+     * @return 固定原子ならtrue
+     * @note 戻り値は(N, )のtorch::Tensorです。固定原子がなければ未定義です。
+     */
+    const torch::Tensor& frozen() const { return frozen_; }
     /**
      * @brief すべての原子の原子番号を取得
      * @return 原子番号
@@ -126,6 +138,14 @@ public:
      * @param[in] potential_energy 新しいポテンシャル
      */
     void set_potential_energy(const torch::Tensor& potential_energy);
+    /**
+     * @brief ビリアルを設定
+     * 
+     * ビリアルは(3, 3)のtorch::Tensorでなければなりません。
+     * 
+     * @param[in] virial 新しいビリアル
+     */
+    void set_virial(const torch::Tensor& virial);
     /**
      * @brief すべての原子の原子番号を指定
      * 
@@ -142,6 +162,39 @@ public:
      * @param[in] types 新しい元素記号
      */
     void set_types(const std::vector<std::string>& types);
+    /**
+     * @brief 固定原子を設定
+     * 
+     * 固定原子は力による速度の更新から除外され、速度は常に0になります。温度の自由度にも含めません。
+     * 固定原子は(N, )のbool型のtorch::Tensorでなければなりません。
+     * 
+     * @param[in] frozen 固定原子ならtrue（すべてfalseなら固定を解除）
+     */
+    void set_frozen(const torch::Tensor& frozen);
+
+    //原子の選択
+    /**
+     * @brief 元素記号で原子を選択
+     * @return 選択した原子ならtrueの(N, )のtorch::Tensor
+     * @param[in] species 元素記号のリスト
+     */
+    torch::Tensor select_by_species(const std::vector<std::string>& species) const;
+    /**
+     * @brief 番号の範囲で原子を選択
+     * @return 選択した原子ならtrueの(N, )のtorch::Tensor
+     * @param[in] first 最初の番号
+     * @param[in] last 最後の番号（この番号も含む）
+     */
+    torch::Tensor select_by_index(const IntType first, const IntType last) const;
+    /**
+     * @brief 座標の範囲で原子を選択
+     * @return 選択した原子ならtrueの(N, )のtorch::Tensor
+     * @param[in] axis 軸（0: x, 1: y, 2: z）
+     * @param[in] lower 下限 (Å)
+     * @param[in] upper 上限 (Å)（この値は含まない）
+     * @note 座標は周期境界条件の補正により[-L/2, L/2)の範囲にあります。
+     */
+    torch::Tensor select_by_region(const IntType axis, const RealType lower, const RealType upper) const;
 
     //物理量の計算
     /**
@@ -156,6 +209,18 @@ public:
      * @note 戻り値は0次元のtorch::Tensorです。
      */
     torch::Tensor potential_energy() const { return potential_energy_; }
+    /**
+     * @brief ビリアルを取得
+     * @return ビリアル W = -Σ r_ij ⊗ ∂E/∂r_ij (eV)
+     * @note 戻り値は(3, 3)のtorch::Tensorです。エネルギーの微分から力を求める場合のみ計算されます。
+     */
+    const torch::Tensor& virial() const { return virial_; }
+    /**
+     * @brief ビリアルと運動エネルギーから圧力を計算して、返す
+     * @return 圧力 P = (2K + tr W) / 3V
+     * @note 戻り値は0次元のtorch::Tensorです。
+     */
+    torch::Tensor pressure() const;
     /**
      * @brief 系の温度を計算して、返す
      * @return 温度
@@ -222,6 +287,10 @@ private:
     //系のデータ
     torch::Tensor n_atoms_;
     torch::Tensor potential_energy_;
+    torch::Tensor virial_;      //(3, 3)
+    torch::Tensor frozen_;      //(num_atoms, )、固定原子がなければ未定義
+    torch::Tensor mobile_;      //(num_atoms, 1)、可動原子なら1
+    torch::Tensor n_mobile_;
     torch::Tensor box_size_;
 
     //定数
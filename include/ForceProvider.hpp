@@ -0,0 +1,49 @@
+/**
+* @file ForceProvider.hpp
+* @brief ForceProviderクラスと、その実装
+*/
+
+#ifndef FORCE_PROVIDER_HPP
+#define FORCE_PROVIDER_HPP
+
+#include "Atoms.hpp"
+#include "NeighbourList.hpp"
+#include "config.h"
+
+#include <string>
+
+/**
+ * @brief 力とポテンシャルの計算方法（ポテンシャルのバックエンド）
+ *
+ * MDの積分・出力・統計は計算方法によらず共通で、毎ステップcalc_energy_and_force()を1回呼ぶだけです。
+ * 新しいポテンシャル（ネイティブのカーネルなど）は、このクラスを継承してMD::set_force_provider()で設定します。
+ * 計算方法はシミュレーションの前に1度だけ選び、ループの中では切り替えません。
+ */
+class ForceProvider {
+    public:
+        virtual ~ForceProvider() = default;
+
+        /**
+         * @brief 系のポテンシャルと力を計算して、系にセット
+         * @param[in] atoms 系
+         * @param[in] NL 隣接リスト（呼び出し側で更新済み）
+         */
+        virtual void calc_energy_and_force(Atoms& atoms, NeighbourList& NL) = 0;
+        /**
+         * @brief 計算方法の名前を取得
+         * @return 名前
+         */
+        virtual std::string name() const = 0;
+};
+
+/**
+ * @brief LJポテンシャル（2成分のLJユニット）による力の計算
+ * @note テスト用です。LJ::calc_energy_and_force()を呼ぶだけです。
+ */
+class LJForceProvider : public ForceProvider {
+    public:
+        void calc_energy_and_force(Atoms& atoms, NeighbourList& NL) override;
+        std::string name() const override { return "LJ"; }
+};
+
+#endif
@@ -0,0 +1,188 @@
+/**
+* @file GraphWorkspace.hpp
+* @brief GraphWorkspaceクラス
+*/
+
+#ifndef GRAPH_WORKSPACE_HPP
+#define GRAPH_WORKSPACE_HPP
+
+#include "Atoms.hpp"
+#include "NeighbourList.hpp"
+#include "config.h"
+
+#include <torch/torch.h>
+
+#include <tuple>
+
+/**
+ * @brief 隣接リストからモデルの入力グラフを作るための作業領域
+ *
+ * エッジ数に応じて容量を確保したバッファを保持し、毎ステップのグラフ構築をout=形式の演算で
+ * バッファへ直接書き込みます。隣接リストのインデックスを結合したedge_indexは、隣接リストが
+ * 再構築されるまで使い回します。定常状態（隣接リストの再構築がないステップ）では、
+ * グラフ構築でtorch::Tensorの記憶領域を新たに確保しません。
+ *
+ * パディングを有効にすると、エッジ数を段階的な大きさ（バケット）に切り上げ、余りをダミーのエッジで埋めます。
+ * モデルに入るテンソルの形状が少数に限られるため、TorchScriptの再特殊化やアロケータの確保し直しが起きにくくなります。
+ *
+ * 部分グラフを有効にすると、可動原子から指定したホップ数以内の原子だけを残し、番号を詰めた部分グラフを返します。
+ * 固定原子が大半を占める系では、推論のコストが可動原子の周りの領域の大きさに比例するようになります。
+ */
+class GraphWorkspace {
+    public:
+        //コンストラクタ
+        /**
+         * @param[in] growth 容量が足りないときに、必要なエッジ数の何倍を確保するか（1以上）
+         */
+        explicit GraphWorkspace(const RealType growth = 1.2);
+
+        /**
+         * @brief 隣接リストからモデルの入力グラフを作成
+         *
+         * inference::RadiusInteractionGraph(atoms, NL)と同じグラフを返します。
+         *
+         * @return 原子番号・接続情報
+         * - `first` (torch::Tensor) 原子番号
+         * (N, )のtorch::Tensor
+         * - `second` (torch::Tensor) グラフの接続情報
+         * (2, num_edges)のtorch::Tensor
+         * - `third` (torch::Tensor) 接続している原子同士の距離ベクトル
+         * (num_edges, 3)のtorch::Tensor
+         * @param[in] atoms 系
+         * @param[in] NL 隣接リスト
+         * @note 戻り値の接続情報と距離ベクトルは作業領域のバッファのビューです。次にbuild()を呼ぶと上書きされます。
+         */
+        std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> build(const Atoms& atoms, const NeighbourList& NL);
+        /**
+         * @brief 直前のbuild()で作成したグラフを取得
+         *
+         * 同じ構造に対して複数のモデルを推論する場合に、グラフを作り直さずに使い回すために用います。
+         *
+         * @return build()の戻り値と同じもの（まだbuild()を呼んでいなければ未定義のtorch::Tensor）
+         * @note 原子の位置を更新した後は、build()を呼び直してください。
+         */
+        const std::tuple<torch::Tensor, torch::Tensor, torch::Tensor>& last_graph() const { return last_graph_; }
+
+        /**
+         * @brief 確保しているエッジ数の容量を取得
+         * @return 容量
+         */
+        IntType capacity() const { return capacity_; }
+        /**
+         * @brief パディングが有効かを取得
+         * @return 有効ならtrue
+         */
+        bool padding() const { return padding_; }
+        /**
+         * @brief 部分グラフが有効かを取得
+         * @return 有効ならtrue
+         */
+        bool subgraph() const { return mobile_.defined() && subgraph_hops_ > 0; }
+        /**
+         * @brief 可動原子を取得
+         * @return 可動原子ならtrueの(N, )のtorch::Tensor（固定原子がなければ未定義）
+         */
+        const torch::Tensor& mobile() const { return mobile_; }
+
+        /**
+         * @brief エッジ数のパディングを設定
+         *
+         * ダミーのエッジは原子0の自己ループで、距離ベクトルの長さはカットオフ距離の2倍です。
+         *
+         * @param[in] padding パディングを行うか
+         * @note ダミーのエッジの寄与が0になるのは、モデルがカットオフ距離以遠で0になる包絡関数を掛け、
+         * メッセージを和で集約する場合です。平均による集約など、エッジ数に依存するモデルには使えません。
+         */
+        void set_padding(const bool padding);
+        /**
+         * @brief エッジ数をバケットの大きさに切り上げる
+         *
+         * 256本以上、かつエッジ数の1/16程度（2のべき）の刻みで切り上げるため、余分なエッジは高々6.25%程度です。
+         *
+         * @return 切り上げたエッジ数
+         * @param[in] num_edges エッジ数
+         */
+        static IntType bucket(const IntType num_edges);
+        /**
+         * @brief 部分グラフへの制限を設定
+         *
+         * 隣接リストの再構築のたびに、可動原子から隣接リストのエッジをhopsホップたどって届く原子を求め、
+         * 両端がその中にあるエッジのみからなる部分グラフを作ります。原子の番号は部分グラフの中で詰め直します。
+         *
+         * @param[in] mobile 可動原子ならtrueの(N, )のtorch::Tensor（未定義なら制限しない）
+         * @param[in] hops 可動原子から何ホップ以内の原子を残すか（0以下なら制限しない）
+         * @note 可動原子の力を全体のグラフと一致させるには、メッセージパッシングの層数をLとして、hops ≥ 2Lとしてください。
+         * ポテンシャルは部分グラフのものになります。前回と同じmobile・hopsを渡した場合は、残す原子を求め直しません。
+         */
+        void set_subgraph(const torch::Tensor& mobile, const IntType hops);
+        /**
+         * @brief 部分グラフの原子ごとの値を、系全体の原子の並びに戻す
+         * @return (N, ...)のtorch::Tensor（部分グラフに含まれない原子は0）
+         * @param[in] values 直前のbuild()で作成したグラフの原子ごとの値 (A, ...)
+         * @note 部分グラフが無効な場合は、valuesをそのまま返します。
+         */
+        torch::Tensor scatter_to_atoms(const torch::Tensor& values) const;
+        /**
+         * @brief 隣接リストのエッジをたどって、原子の集合を広げる
+         * @return hopsホップ以内に届く原子ならtrueの(N, )のtorch::Tensor
+         * @param[in] atoms 出発する原子ならtrueの(N, )のtorch::Tensor
+         * @param[in] NL 隣接リスト（ハーフリストでも両方向にたどります）
+         * @param[in] hops ホップ数
+         */
+        static torch::Tensor expand_hops(const torch::Tensor& atoms, const NeighbourList& NL, const IntType hops);
+
+        /**
+         * @brief 作業領域を解放し、次のbuild()で作り直す
+         */
+        void clear();
+
+    private:
+        /**
+         * @brief 隣接リストが変わったときに、エッジのインデックスとカットオフ距離をキャッシュし直す
+         * @param[in] atoms 系
+         * @param[in] NL 隣接リスト
+         */
+        void prepare(const Atoms& atoms, const NeighbourList& NL);
+        /**
+         * @brief 必要に応じてバッファの容量を広げる
+         * @param[in] num_edges 隣接リストのエッジ数
+         * @param[in] directions 出力するエッジの方向数（ハーフリストなら2）
+         * @param[in] options 位置ベクトルのTensorOptions
+         */
+        void reserve(const IntType num_edges, const IntType directions, const torch::TensorOptions& options);
+
+    RealType growth_;                               //容量を広げる際の倍率
+    IntType build_id_ = 0;                          //キャッシュしている隣接リストの識別番号
+    IntType capacity_ = 0;                          //確保しているエッジ数
+    IntType directions_ = 1;                        //出力用バッファが対応しているエッジの方向数（ハーフリストなら2）
+    IntType num_edges_ = 0;                         //隣接リストのエッジ数
+    bool half_ = false;                             //隣接リストがハーフリストか
+    bool padding_ = false;                          //エッジ数をバケットに切り上げるか
+    IntType output_capacity_ = 0;                   //出力用バッファのエッジ数
+    RealType pad_distance_ = 0.0;                   //ダミーのエッジの長さ
+    torch::Tensor mobile_;                          //可動原子 (N, )
+    IntType subgraph_hops_ = 0;                     //部分グラフに残す、可動原子からのホップ数
+
+    //隣接リストごとにキャッシュする値
+    torch::Tensor edge_index_;                      //隣接リストのインデックスを結合したもの (2, num_edges)
+    torch::Tensor cutoff2_;                         //各エッジのカットオフ距離の2乗 (num_edges, ) または (1, )
+    torch::Tensor output_index_;                    //出力する接続情報（部分グラフなら詰め直した番号） (2, num_edges)
+    torch::Tensor active_index_;                    //部分グラフに含まれる原子の番号 (A, )
+    torch::Tensor active_numbers_;                  //部分グラフに含まれる原子の原子番号 (A, )
+    IntType num_atoms_ = 0;                         //系全体の原子数
+
+    //直前に作成したグラフ（出力用バッファのビュー）
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> last_graph_;
+
+    //毎ステップ書き込むバッファ（容量はcapacity_）
+    torch::Tensor source_pos_;                      //ソース原子の位置 (capacity, 3)
+    torch::Tensor diff_pos_vec_;                    //距離ベクトル (capacity, 3)
+    torch::Tensor shift_;                           //周期境界条件の補正・距離の2乗の計算用 (capacity, 3)
+    torch::Tensor dist2_;                           //距離の2乗 (capacity, )
+    torch::Tensor mask_;                            //カットオフ距離以内か (capacity, )
+    torch::Tensor selected_;                        //カットオフ距離以内のエッジの番号 (capacity, 1)
+    torch::Tensor edge_index_buffer_;               //出力する接続情報 (2 * output_capacity, )
+    torch::Tensor distance_vectors_buffer_;         //出力する距離ベクトル (output_capacity, 3)
+};
+
+#endif
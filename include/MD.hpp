@@ -8,6 +8,9 @@
 
 #include "Atoms.hpp"
 #include "NeighbourList.hpp"
+#include "GraphWorkspace.hpp"
+#include "Model.hpp"
+#include "ForceProvider.hpp"
 #include "config.h"
 #include "NoseHooverThermostat.hpp"
 #include "BussiThermostat.hpp"
@@ -15,13 +18,19 @@
 #include <torch/script.h>
 #include <torch/torch.h>
 
+#include <chrono>
+#include <future>
+#include <memory>
 #include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 class MD{
     public:
         //コンストラクタ
-        MD(torch::Tensor dt, torch::Tensor cutoff, torch::Tensor margin, std::string data_path, std::string model_path, torch::Device device = torch::kCPU); 
-        MD(RealType dt, RealType cutoff, RealType margin, std::string data_path, std::string model_path, torch::Device device = torch::kCPU); 
+        MD(torch::Tensor dt, torch::Tensor cutoff, torch::Tensor margin, std::string data_path, std::string model_path, torch::Device device = torch::kCPU, const std::string& model_backend = "torchscript"); 
+        MD(RealType dt, RealType cutoff, RealType margin, std::string data_path, std::string model_path, torch::Device device = torch::kCPU, const std::string& model_backend = "torchscript"); 
         MD(RealType dt, RealType cutoff, RealType margin, const Atoms& atoms, torch::Device device = torch::kCPU); 
 
         //シミュレーション
@@ -147,12 +156,179 @@ class MD{
          * @brief trajectoryファイルの保存先を変更
          */
         void set_traj_path(const std::string& path);
+        /**
+         * @brief 隣接リストの構築方法を変更
+         * @param[in] method 構築方法（"auto", "dense", "cell"のいずれか）
+         * @param[in] cell_threshold "auto"のときにセルリストに切り替える原子数
+         */
+        void set_NL_method(const std::string& method, const IntType cell_threshold);
+        /**
+         * @brief 隣接リストをハーフリスト（i < jのペアのみ）にするかを変更
+         * @param[in] half ハーフリストにするか
+         */
+        void set_NL_half(const bool half);
+        /**
+         * @brief 隣接リストの原子種ペアごとのカットオフ距離を変更
+         * @param[in] spec "Si-O:2.3,Na-O:3.0"のような、元素記号のペアとカットオフ距離 (Å) のカンマ区切りの指定
+         * @note 指定していないペアには、コンストラクタで与えたカットオフ距離を用います。
+         * モデルはカットオフ距離以内のすべてのエッジを使うため、cutoffより短い値は力の計算方法がモデル以外（LJなど）の場合のみ使えます。
+         */
+        void set_NL_pair_cutoffs(const std::string& spec);
+        /**
+         * @brief 隣接リストを全ペアから構築する際のブロックの行数を変更
+         * @param[in] block_size ブロックの行数（0以下ならブロックに分けない）
+         */
+        void set_NL_block_size(const IntType block_size);
+        /**
+         * @brief 隣接リストの各原子の隣接原子を距離順に並べるかを変更
+         * @param[in] sort_by_distance 距離順に並べるか
+         */
+        void set_NL_sort_by_distance(const bool sort_by_distance);
+        /**
+         * @brief 隣接リストのマージンの自動調整を変更
+         * @param[in] auto_margin 自動調整を行うか
+         * @param[in] margin_min マージンの下限 (Å)
+         * @param[in] margin_max マージンの上限 (Å)
+         */
+        void set_NL_auto_margin(const bool auto_margin, const RealType margin_min, const RealType margin_max);
+        /**
+         * @brief 隣接リストの投機的な再構築を変更
+         * @param[in] speculative 再構築が近づいたらバックグラウンドで次の隣接リストを構築するか
+         * @param[in] extra_margin バックグラウンドで構築する隣接リストの追加のマージン (Å)
+         * @param[in] trigger_fraction 構築を始める、変位の和とマージンの比
+         */
+        void set_NL_speculative(const bool speculative, const RealType extra_margin, const RealType trigger_fraction);
+
+        /**
+         * @brief モデルを推論用に最適化したものに置き換え
+         * 
+         * 最適化の前後で、現在の構造に対する1回の推論にかかる時間を計測して出力します。
+         * freeze + optimize_for_inferenceしたモデルで推論できない、または力が変わる場合はfreezeのみにし、
+         * それでも使えなければ元のモデルのままにします。
+         * 
+         * @param[in] cache_dir 最適化したモデルを保存するディレクトリ
+         * @note 詳細はinference::load_optimized_model()を参照してください。バックエンドが"torchscript"の場合のみ有効です。
+         */
+        void optimize_model(const std::string& cache_dir);
+        /**
+         * @brief 最初の隣接リストを構築し、モデルの読み込みを待ってからウォームアップの推論を行う
+         * 
+         * モデルはコンストラクタで別スレッドで読み込み始めているため、構造の読み込みと隣接リストの構築は
+         * モデルの読み込みと並行して行われます。起動から最初のステップの準備までの時間を、モデルの読み込み待ち・
+         * モデルの最適化/量子化・その他に分けて出力し、ウォームアップの時間も別に出力します。
+         * 
+         * @param[in] num_forwards ウォームアップの推論の回数
+         * @note 隣接リストの設定を反映させるため、隣接リストのセッタの後に呼んでください。
+         */
+        void warm_up(const IntType num_forwards);
+        /**
+         * @brief モデルの線形層を動的なint8量子化で置き換え
+         * 
+         * 置き換えの前に、現在の構造に対してfloatのモデルとのポテンシャル・力の誤差と推論時間を出力します。
+         * 
+         * @note CPUかつバックエンドが"torchscript"の場合のみ有効です。詳細はinference::quantize_dynamic_int8()を参照してください。
+         * 力をエネルギーの微分から求める場合（モデルがforwardの中で微分する場合、set_autograd_force(true)の場合）は、
+         * 量子化した線形層を微分できないため、量子化せずに元のモデルを使います。
+         */
+        void quantize_model();
+        /**
+         * @brief モデルに入力するエッジ数のパディングを変更
+         * @param[in] padding エッジ数をバケットの大きさに切り上げ、ダミーのエッジで埋めるか
+         * @note 詳細はGraphWorkspace::set_padding()を参照してください。
+         */
+        void set_edge_padding(const bool padding);
+        /**
+         * @brief 力の計算方法を変更
+         * @param[in] autograd_force trueならモデルのエネルギーを微分して力を求め、falseならモデルが返す力を使う
+         * @note falseの場合、モデルがforwardの中で微分しなければInferenceModeのもとで推論し、
+         * 微分する場合（同梱のモデルなど）は勾配を有効にして推論します。
+         */
+        void set_autograd_force(const bool autograd_force);
+        /**
+         * @brief ビリアルの計算を変更
+         * @param[in] calc_virial trueなら力と同じ勾配からビリアルを求め、圧力をログに出力する
+         * @note エネルギーの微分から力を求める場合（set_autograd_force(true)）のみ有効です。
+         */
+        void set_calc_virial(const bool calc_virial);
+
+        /**
+         * @brief 隣接リストの再構築の回数・平均間隔と現在のマージンを出力し、統計をリセット
+         */
+        void print_NL_statistics();
+        /**
+         * @brief コミッティの力のばらつきの平均・最大値と、保存したフレーム数を出力し、統計をリセット
+         * @note コミッティを設定していない場合は何もしません。
+         */
+        void print_committee_statistics();
+        /**
+         * @brief 力の計算方法を設定
+         * 
+         * 設定した計算方法は、積分・出力・統計を含め、モデルによる推論と同じループで使われます。
+         * 
+         * @param[in] provider 力の計算方法（nullptrならコンストラクタで読み込んだモデルで推論）
+         * @note モデル以外の計算方法では、コミッティ・差分推論・ビリアルの計算は行いません。
+         */
+        void set_force_provider(std::unique_ptr<ForceProvider> provider);
+        /**
+         * @brief 固定原子を設定
+         * 
+         * 固定原子は積分から除外され、動きません。subgraph_hopsが正の場合は、可動原子からそのホップ数以内の
+         * 原子だけからなる部分グラフで推論するため、推論のコストが可動原子の周りの領域の大きさに比例します。
+         * 
+         * @param[in] frozen 固定原子ならtrueの(N, )のtorch::Tensor（Atoms::select_by_species()などで作成）
+         * @param[in] subgraph_hops 部分グラフに残す可動原子からのホップ数（0以下なら全体のグラフで推論）
+         * @note 可動原子の力を全体のグラフと一致させるには、メッセージパッシングの層数をLとして、subgraph_hops ≥ 2Lとしてください。
+         * このとき、出力されるポテンシャルは部分グラフのものになります。熱浴の設定（NVTなど）より前に呼んでください。
+         */
+        void set_frozen(const torch::Tensor& frozen, const IntType subgraph_hops);
+        /**
+         * @brief 近似的な差分推論を設定
+         * 
+         * 最後の全体の推論から許容値より動いた原子の受容野にある原子の力だけを計算し直し、それ以外の原子は
+         * 最後の全体の推論の力を使い回します。interval回に1回は全体を推論し、そのときの差分推論との差を記録します。
+         * 低温で多くの原子がほとんど動かない系で、推論のコストを下げるために用います。
+         * 
+         * @param[in] tolerance 動いたとみなす変位 (Å)（0以下なら差分推論を使わない）
+         * @param[in] interval 何回に1回全体を推論するか
+         * @param[in] hops 力の受容野のホップ数（メッセージパッシングの層数をLとして、2Lとしてください）
+         * @note モデルが返す力を使う場合（set_autograd_force(false)）のみ有効です。
+         * 差分推論のステップでは、コミッティによる外挿の検出は行いません。
+         */
+        void set_incremental(const RealType tolerance, const IntType interval, const IntType hops);
+        /**
+         * @brief 差分推論の回数・再計算した原子の数・全体の推論との差を出力し、統計をリセット
+         * @note 差分推論を使っていない場合は何もしません。
+         */
+        void print_incremental_statistics();
+        /**
+         * @brief コミッティのモデルを設定
+         * 
+         * 毎ステップ、シミュレーションに使うモデルと同じグラフでコミッティの各モデルを推論し、
+         * 原子ごとの力の標準偏差の最大値を求めます。閾値を超えたステップの構造はdump_pathに追記します（能動学習用）。
+         * シミュレーションにはコミッティの平均ではなく、コンストラクタで読み込んだモデルの力を使います。
+         * 
+         * @param[in] model_paths シミュレーションに使うモデル以外のコミッティのモデルのパス（空ならコミッティを使わない）
+         * @param[in] threshold 構造を保存する力の標準偏差の閾値 (eV/Å)
+         * @param[in] dump_path 閾値を超えた構造の保存先
+         * @note モデルはシミュレーションに使うモデルと同じバックエンド・デバイスで読み込みます。
+         */
+        void set_committee(const std::vector<std::string>& model_paths, const RealType threshold, const std::string& dump_path);
+        /**
+         * @brief 直前の力の計算でのコミッティの力のばらつきを取得
+         * @return 原子ごとの力の標準偏差の最大値 (eV/Å)（コミッティを設定していなければ0）
+         */
+        RealType force_deviation() const { return force_deviation_; }
 
         /**
          * @brief 系の読み込み
          */
         void load_atoms(const std::string& path);
 
+        /**
+         * @brief 系を取得
+         * @return 系
+         */
+        const Atoms& atoms() const { return atoms_; }
         /**
          * @brief 現在の運動温度を取得
          */
@@ -176,11 +352,52 @@ class MD{
          * @brief 経過時間・運動エネルギー・ポテンシャルエネルギー・全エネルギー・温度を出力
          */
         void print_energies();                                          //結果の出力
+        /**
+         * @brief ログの見出しの圧力の列
+         * @return ビリアルを計算している場合は圧力の列名、それ以外は空文字列
+         */
+        const char* pressure_header() const;
 
         /**
          * @brief NVEシミュレーションを1ステップ行う
          */
         void step();                                  //1ステップ
+        /**
+         * @brief 現在の系のポテンシャルと力を計算して、系にセット
+         * 
+         * set_autograd_force()の設定に応じて、モデルが返す力を使うか、エネルギーの微分から力を求めるかを切り替えます。
+         */
+        void calc_energy_and_force();
+        /**
+         * @brief 別スレッドでのモデルの読み込みが終わっていなければ待つ
+         * @return 待った時間 (s)
+         */
+        double wait_for_model();
+        /**
+         * @brief コミッティの力のばらつきを計算し、閾値を超えていれば構造を保存
+         */
+        void check_committee();
+        /**
+         * @brief 差分推論でポテンシャルと力を計算して、系にセット
+         * 
+         * 最後の全体の推論からincremental_interval_回目ごとに全体を推論し、それ以外のステップでは
+         * incremental_estimate()の値を使います。全体を推論するステップでは、先に差分推論の値も求めて誤差を記録します。
+         * 
+         * @return 全体を推論したか
+         */
+        bool calc_energy_and_force_incremental();
+        /**
+         * @brief 差分推論によるポテンシャルと力の推定値を計算
+         * 
+         * 最後の全体の推論から許容値より動いた原子を求め、その受容野（incremental_hops_ホップ以内）にある原子の力だけを
+         * その周りの部分グラフで計算し直します。それ以外の原子は、最後の全体の推論の力を使います。
+         * ポテンシャルは、前のステップの値から力の仕事を台形則で積分して求めます。
+         * 
+         * @return ポテンシャル・力
+         * - `first` (torch::Tensor) ポテンシャル
+         * - `second` (torch::Tensor) それぞれの原子が受ける力 (N, 3)
+         */
+        std::pair<torch::Tensor, torch::Tensor> incremental_estimate();
         /**
          * @brief NVTシミュレーションを1ステップ行う
          * 
@@ -227,18 +444,11 @@ class MD{
         void NVT_anneal_loop(const RealType cooling_rate, ThermostatType& Thermostat, const RealType targ_temp, OutputAction output_action);
 
         //テスト用
-        void step_LJ(torch::Tensor& box);                                  //1ステップ
-        void step_LJ(torch::Tensor& box, NoseHooverThermostat& Thermostat);
-        void step_LJ(torch::Tensor& box, BussiThermostat& Thermostat);
-
-        template <typename OutputAction>
-        void NVE_loop_LJ(const RealType tsim, const RealType temp, OutputAction output_action);
-
-        template <typename OutputAction, typename ThermostatType>
-        void NVT_loop_LJ(const RealType tsim, ThermostatType& Thermostat, OutputAction output_action);
-
-        template <typename OutputAction, typename ThermostatType>
-        void NVT_anneal_loop_LJ(const RealType cooling_rate, ThermostatType& Thermostat, const RealType targ_temp, OutputAction output_action);
+        /**
+         * @brief 力の計算方法をLJポテンシャルにし、最初の力の計算と出力を行う
+         * @param[in] header ログの見出し
+         */
+        void setup_LJ(const std::string& header);
 
         //シミュレーション用
         IntType t_;                                                     //現在のステップ数
@@ -248,12 +458,53 @@ class MD{
         torch::Tensor Lbox_;                                            //シミュレーションセルのサイズ
         torch::Tensor Linv_;                                            //セルのサイズの逆数
         NeighbourList NL_;                                              //隣接リスト
+        GraphWorkspace graph_;                                          //グラフ構築の作業領域
+        std::unique_ptr<ForceProvider> force_provider_;                 //モデル以外の力の計算方法（nullptrならモデルで推論）
+
+        //差分推論
+        RealType incremental_tolerance_ = 0.0;                           //動いたとみなす変位 (Å)（0以下なら無効）
+        IntType incremental_interval_ = 1;                               //何回に1回全体を推論するか
+        IntType incremental_hops_ = 0;                                   //力の受容野のホップ数
+        IntType steps_since_full_ = 0;                                   //最後の全体の推論からの回数
+        GraphWorkspace incremental_graph_;                               //差分推論の部分グラフの作業領域
+        torch::Tensor reference_positions_;                              //最後に全体を推論したときの位置 (N, 3)
+        torch::Tensor incremental_moved_;                                //前回の差分推論で動いたとみなした原子 (N, )
+        torch::Tensor incremental_affected_;                             //incremental_moved_の受容野にある原子 (N, )
+        IntType incremental_NL_id_ = 0;                                  //incremental_affected_を求めたときの隣接リストの識別番号
+        torch::Tensor cached_forces_;                                    //最後に全体を推論したときの力 (N, 3)
+        torch::Tensor previous_positions_;                               //前のステップの位置（ポテンシャルの積分用） (N, 3)
+        torch::Tensor previous_forces_;                                  //前のステップの力（ポテンシャルの積分用） (N, 3)
+        IntType full_evaluations_ = 0;                                   //統計用：全体の推論の回数
+        IntType incremental_evaluations_ = 0;                            //統計用：差分推論の回数
+        RealType recomputed_atoms_sum_ = 0.0;                            //統計用：差分推論で力を計算し直した原子の数の和
+        IntType error_checks_ = 0;                                       //統計用：全体の推論と比べた回数
+        RealType force_error_sum_ = 0.0;                                 //統計用：力の差の最大値の和
+        RealType force_error_max_ = 0.0;                                 //統計用：力の差の最大値の最大値 (eV/Å)
+        RealType energy_error_max_ = 0.0;                                //統計用：ポテンシャルの差の最大値 (eV)
+
+        //コミッティ
+        std::vector<Model> committee_;                                   //シミュレーションに使うモデル以外のコミッティのモデル
+        RealType committee_threshold_ = 0.0;                             //構造を保存する力の標準偏差の閾値 (eV/Å)
+        std::string committee_dump_path_;                                //閾値を超えた構造の保存先
+        bool committee_dump_ = true;                                     //閾値を超えた構造を保存するか（ウォームアップ中は保存しない）
+        RealType force_deviation_ = 0.0;                                 //直前の力の標準偏差の最大値
+        RealType force_deviation_sum_ = 0.0;                             //統計用：力の標準偏差の最大値の和
+        RealType force_deviation_max_ = 0.0;                             //統計用：力の標準偏差の最大値の最大値
+        IntType committee_evaluations_ = 0;                              //統計用：コミッティで推論した回数
+        IntType committee_dumps_ = 0;                                    //統計用：保存した構造の数
 
         torch::Tensor box_;                                             //周期境界条件のもとで、何個目の箱のミラーに位置しているのかを保存する変数 (N, 3)
         std::string traj_path_;                                         //trajectoryを保存するパス
 
         //MLP用変数
-        torch::jit::script::Module module_;                              //モデルを格納する変数
+        Model model_;                                                    //モデルを格納する変数
+        std::future<Model> model_future_;                                //別スレッドで読み込み中のモデル
+        std::string model_backend_ = "torchscript";                      //モデルのバックエンド（読み込みを待たずに参照する）
+        std::chrono::steady_clock::time_point startup_begin_;            //コンストラクタの開始時刻
+        double model_wait_time_ = 0.0;                                   //モデルの読み込みを待った時間の合計 (s)
+        double model_preparation_time_ = 0.0;                            //モデルの最適化・量子化にかかった時間 (s)
+        bool autograd_force_ = false;                                    //エネルギーの微分から力を求めるか
+        bool calc_virial_ = false;                                       //ビリアルを計算するか
 
         //系
         Atoms atoms_;                                                    //原子
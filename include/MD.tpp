@@ -3,15 +3,24 @@
 #include "xyz.hpp"
 #include "inference.hpp"
 #include "config.h"
-#include "LJ.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <tuple>
 
 //=====コンストラクタ=====
-MD::MD(torch::Tensor dt, torch::Tensor cutoff, torch::Tensor margin, std::string data_path, std::string model_path, torch::Device device)
-   : dt_(dt), NL_(cutoff, margin, device), device_(device), atoms_(Atoms(device))
+MD::MD(torch::Tensor dt, torch::Tensor cutoff, torch::Tensor margin, std::string data_path, std::string model_path, torch::Device device, const std::string& model_backend)
+   : dt_(dt), NL_(cutoff, margin, device), device_(device), atoms_(Atoms(device)), model_backend_(model_backend)
 {
+    startup_begin_ = std::chrono::steady_clock::now();
+
     //モデルの読み込み
-    module_ = inference::load_model(model_path);
-    module_.to(device);
+    //構造の読み込み・最初の隣接リストの構築と並行して、別スレッドで行う（warm_up()などで待つ）
+    model_future_ = std::async(std::launch::async, [model_path, device, model_backend]() {
+        return Model(model_path, device, model_backend);
+    });
 
     //初期構造のロード
     xyz::load_atoms(data_path, atoms_, device);
@@ -34,11 +43,11 @@ MD::MD(torch::Tensor dt, torch::Tensor cutoff, torch::Tensor margin, std::string
     traj_path_ = "./trajectory.xyz";
 }
 
-MD::MD(RealType dt, RealType cutoff, RealType margin, std::string data_path, std::string model_path, torch::Device device)
+MD::MD(RealType dt, RealType cutoff, RealType margin, std::string data_path, std::string model_path, torch::Device device, const std::string& model_backend)
    : MD(torch::tensor(dt, torch::TensorOptions().device(device).dtype(kRealType)), 
         torch::tensor(cutoff, torch::TensorOptions().device(device).dtype(kRealType)), 
         torch::tensor(margin, torch::TensorOptions().device(device).dtype(kRealType)), 
-        data_path, model_path, device) {}
+        data_path, model_path, device, model_backend) {}
 
 MD::MD(RealType dt, RealType cutoff, RealType margin, const Atoms& atoms, torch::Device device) : dt_(torch::tensor(dt, torch::TensorOptions().device(device).dtype(kRealType))), device_(device), atoms_(atoms), NL_(torch::tensor(cutoff, torch::TensorOptions().device(device).dtype(kRealType)), torch::tensor(margin, torch::TensorOptions().device(device).dtype(kRealType)), device) {
     num_atoms_ = atoms_.size();
@@ -55,6 +64,9 @@ MD::MD(RealType dt, RealType cutoff, RealType margin, const Atoms& atoms, torch:
     dt_real_ = dt_.item<RealType>();
     box_ = torch::zeros({num_atoms_.item<IntType>(), 3}, torch::TensorOptions().dtype(kIntType).device(device_));
     traj_path_ = "./trajectory.xyz";
+
+    //モデルを読み込まないため、LJポテンシャルで力を計算する
+    force_provider_ = std::make_unique<LJForceProvider>();
 }
 
 //=====シミュレーション=====
@@ -63,13 +75,13 @@ MD::MD(RealType dt, RealType cutoff, RealType margin, const Atoms& atoms, torch:
 //NVEシミュレーション
 void MD::NVE(const RealType tsim, const RealType temp, const IntType step, const bool is_save) {
     //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)" << std::endl;
+    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)" << pressure_header() << std::endl;
 
     //NLの作成
     NL_.generate(atoms_);
 
     //モデルの推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
     print_energies();
 
     if (is_save) xyz::save_unwrapped_atoms(traj_path_, atoms_, box_);
@@ -99,13 +111,13 @@ void MD::NVE(const RealType tsim, const RealType temp, const std::string log, co
     }
 
     //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)" << std::endl;
+    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)" << pressure_header() << std::endl;
 
     //NLの作成
     NL_.generate(atoms_);
 
     //モデルの推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
     print_energies();
 
     if (is_save) xyz::save_unwrapped_atoms(traj_path_, atoms_, box_);
@@ -147,13 +159,13 @@ void MD::NVT(const RealType tsim, ThermostatType& Thermostat, const IntType step
     Thermostat.setup(atoms_);
 
     //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << std::endl;
+    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << pressure_header() << std::endl;
 
     //NLの作成
     NL_.generate(atoms_);
 
     //モデルの推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
     print_energies();
     if (is_save) xyz::save_unwrapped_atoms(traj_path_, atoms_, box_);
 
@@ -195,13 +207,13 @@ void MD::NVT(const RealType tsim,
 
     // ログの見出しを出力
     std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、"
-                 "total energy (eV)、temperature (K)" << std::endl;
+                 "total energy (eV)、temperature (K)" << pressure_header() << std::endl;
 
     // NL の作成
     NL_.generate(atoms_);
 
     // モデルの推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
 
     // 初期状態を 1 回出力（run の t=0 に相当）
     print_energies();
@@ -287,10 +299,10 @@ void MD::NVT_anneal(const RealType cooling_rate, ThermostatType& Thermostat, con
     NL_.generate(atoms_);
 
     //モデルの推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
 
     //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << std::endl;
+    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << pressure_header() << std::endl;
 
     print_energies();
     if (is_save) xyz::save_unwrapped_atoms(traj_path_, atoms_, box_);
@@ -337,11 +349,11 @@ void MD::NVT_anneal(const RealType cooling_rate,
     NL_.generate(atoms_);
 
     // MLP 推論
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_);
+    calc_energy_and_force();
 
     // ログヘッダ
     std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、"
-                 "total energy (eV)、temperature (K)" << std::endl;
+                 "total energy (eV)、temperature (K)" << pressure_header() << std::endl;
 
     // 初期出力（run の t=0）
     print_energies();
@@ -410,13 +422,143 @@ void MD::NVT_anneal(const RealType cooling_rate,
     NVT_anneal_loop(cooling_rate, Thermostat, targ_temp, callback);
 }
 
+//=====力の計算=====
+void MD::calc_energy_and_force() {
+    //モデル以外の計算方法が設定されている場合
+    if(force_provider_) {
+        //マージンの自動調整のため、隣接リストのペアを処理する時間を記録
+        auto start = std::chrono::steady_clock::now();
+        force_provider_->calc_energy_and_force(atoms_, NL_);
+        if(NL_.auto_margin()) {
+            NL_.record_graph_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return;
+    }
+
+    wait_for_model();
+    bool full_evaluation = true;
+    if(autograd_force_) {
+        //エネルギーの微分から力を計算
+        //TorchScriptのモデルのみ（それ以外のバックエンドではmodule()が例外を投げる）
+        inference::infer_energy_with_MLP_and_clac_force(model_.module(), atoms_, NL_, graph_, calc_virial_);
+    }
+    else if(incremental_tolerance_ > 0) {
+        //動いた原子の周りだけを推論し直す
+        full_evaluation = calc_energy_and_force_incremental();
+    }
+    else {
+        //モデルが返す力をそのまま使う（モデルがforwardの中で微分しない場合のみInferenceMode）
+        inference::calc_energy_and_force_MLP(model_, atoms_, NL_, graph_);
+    }
+
+    //コミッティによる外挿の検出（graph_で全体を推論したステップのみ）
+    if(!committee_.empty() && full_evaluation) {
+        check_committee();
+    }
+}
+
+//差分推論による力の計算
+bool MD::calc_energy_and_force_incremental() {
+    steps_since_full_++;
+    if(reference_positions_.defined() && steps_since_full_ < incremental_interval_) {
+        //差分推論
+        torch::Tensor energy, forces;
+        std::tie(energy, forces) = incremental_estimate();
+        atoms_.set_potential_energy(energy);
+        atoms_.set_forces(forces);
+        previous_positions_ = atoms_.positions().clone();
+        previous_forces_ = forces;
+        incremental_evaluations_++;
+        return false;
+    }
+
+    //誤差の監視のため、全体を推論する前に差分推論の値も求めておく
+    torch::Tensor estimated_energy, estimated_forces;
+    if(reference_positions_.defined()) {
+        std::tie(estimated_energy, estimated_forces) = incremental_estimate();
+    }
+
+    //全体の推論
+    inference::calc_energy_and_force_MLP(model_, atoms_, NL_, graph_);
+
+    if(estimated_forces.defined()) {
+        const RealType force_error = (atoms_.forces() - estimated_forces).norm(2, 1).max().item<RealType>();
+        const RealType energy_error = (atoms_.potential_energy() - estimated_energy).abs().item<RealType>();
+        force_error_sum_ += force_error;
+        force_error_max_ = std::max(force_error_max_, force_error);
+        energy_error_max_ = std::max(energy_error_max_, energy_error);
+        error_checks_++;
+    }
+
+    //次の差分推論の基準
+    reference_positions_ = atoms_.positions().clone();
+    cached_forces_ = atoms_.forces();
+    previous_positions_ = reference_positions_;
+    previous_forces_ = cached_forces_;
+    steps_since_full_ = 0;
+    full_evaluations_++;
+    return true;
+}
+
+//差分推論による推定値
+std::pair<torch::Tensor, torch::Tensor> MD::incremental_estimate() {
+    const torch::Tensor& positions = atoms_.positions();
+
+    //最後の全体の推論からの変位（最小イメージ）
+    torch::Tensor displacement = positions - reference_positions_;
+    displacement -= Lbox_ * torch::round(displacement / Lbox_);
+    torch::Tensor moved = displacement.norm(2, 1) > incremental_tolerance_;
+
+    torch::Tensor forces = cached_forces_;
+    if(moved.any().item<bool>()) {
+        //動いた原子の受容野にある原子の力を、その周りの部分グラフで計算し直す
+        //動いた原子の集合と隣接リストが前回と同じなら、受容野と部分グラフのインデックスを使い回す
+        if(!incremental_moved_.defined() || incremental_NL_id_ != NL_.build_id() || !torch::equal(moved, incremental_moved_)) {
+            incremental_moved_ = moved;
+            incremental_NL_id_ = NL_.build_id();
+            incremental_affected_ = GraphWorkspace::expand_hops(moved, NL_, incremental_hops_);
+        }
+        const torch::Tensor& affected = incremental_affected_;
+        incremental_graph_.set_subgraph(affected, incremental_hops_);
+
+        torch::Tensor x, edge_index, edge_weight;
+        std::tie(x, edge_index, edge_weight) = incremental_graph_.build(atoms_, NL_);
+        torch::Tensor recomputed = incremental_graph_.scatter_to_atoms(model_.forward(x, edge_index, edge_weight).second.to(kRealType));
+        forces = torch::where(affected.unsqueeze(1), recomputed, cached_forces_);
+        recomputed_atoms_sum_ += affected.sum().item<RealType>();
+    }
+
+    //ポテンシャルは、前のステップからの力の仕事を台形則で積分する
+    torch::Tensor step = positions - previous_positions_;
+    step -= Lbox_ * torch::round(step / Lbox_);
+    torch::Tensor energy = atoms_.potential_energy() - 0.5 * ((forces + previous_forces_) * step).sum();
+
+    return {energy, forces};
+}
+
+//コミッティの力のばらつき
+void MD::check_committee() {
+    //力を求めたときのグラフを使い回して推論する
+    force_deviation_ = inference::committee_force_deviation(committee_, atoms_.forces(), graph_).item<RealType>();
+
+    force_deviation_sum_ += force_deviation_;
+    force_deviation_max_ = std::max(force_deviation_max_, force_deviation_);
+    committee_evaluations_++;
+
+    //閾値を超えた構造を保存
+    if(committee_dump_ && force_deviation_ > committee_threshold_) {
+        xyz::save_unwrapped_atoms(committee_dump_path_, atoms_, box_);
+        committee_dumps_++;
+    }
+}
+
 //=====シミュレーション（1ステップ）=====
 //NVEの1ステップ
 void MD::step() {
     atoms_.velocities_update(dt_);      //速度の更新（1回目）
     atoms_.positions_update(dt_, box_);  //位置の更新
     NL_.update(atoms_);                 //NLの確認と更新
-    inference::calc_energy_and_force_MLP(module_, atoms_, NL_); //力の更新
+    calc_energy_and_force(); //力の更新
     atoms_.velocities_update(dt_);      //速度の更新（2回目）
 }
 
@@ -519,11 +661,9 @@ void MD::init_temp(const RealType initial_temp){
     //この時、velocities (N, 3)とsigma (N, )を計算するために、sigma (N, ) -> (N, 1)
     velocities *= sigma.unsqueeze(1);
 
-    //全体速度の除去
-    torch::Tensor drift_velocity = torch::mean(velocities, 0);
-    velocities -= drift_velocity;
-
+    //全体速度の除去（固定原子がある場合は、可動原子のみ）
     atoms_.set_velocities(velocities);
+    atoms_.remove_drift();
 }
 
 //エネルギーの出力
@@ -537,7 +677,60 @@ void MD::print_energies(){
                                                           << K << "," 
                                                           << U << "," 
                                                           << K + U << "," 
-                                                          << temperature << std::endl;
+                                                          << temperature;
+    //ビリアルを計算している場合は圧力も出力
+    if(calc_virial_ && autograd_force_) {
+        std::cout << "," << atoms_.pressure().item<RealType>();
+    }
+    std::cout << std::endl;
+}
+
+const char* MD::pressure_header() const {
+    return (calc_virial_ && autograd_force_) ? "、pressure (eV/Å^3)" : "";
+}
+
+//隣接リストの統計の出力
+void MD::print_NL_statistics(){
+    std::cout << "隣接リストの再構築: " << NL_.num_rebuilds() << " 回、"
+              << "平均間隔: " << NL_.mean_rebuild_interval() << " ステップ、"
+              << "マージン: " << NL_.margin().item<RealType>() << " Å" << (NL_.auto_margin() ? "（自動調整）" : "");
+    if(NL_.speculative()){
+        std::cout << "、バックグラウンドで構築したリストへの入れ替え: " << NL_.num_speculative_swaps() << " 回";
+    }
+    std::cout << std::endl;
+    NL_.reset_statistics();
+}
+
+void MD::print_incremental_statistics(){
+    if(incremental_tolerance_ <= 0){
+        return;
+    }
+    const RealType recomputed = incremental_evaluations_ > 0 ? recomputed_atoms_sum_ / incremental_evaluations_ : 0.0;
+    const RealType force_error = error_checks_ > 0 ? force_error_sum_ / error_checks_ : 0.0;
+    std::cout << "差分推論: 全体の推論 " << full_evaluations_ << " 回、差分推論 " << incremental_evaluations_ << " 回"
+              << "（再計算した原子: 平均 " << recomputed << " / " << num_atoms_.item<IntType>() << " 個）、"
+              << "全体の推論との差: 力 平均 " << force_error << " eV/Å・最大 " << force_error_max_ << " eV/Å、"
+              << "ポテンシャル 最大 " << energy_error_max_ << " eV" << std::endl;
+    full_evaluations_ = 0;
+    incremental_evaluations_ = 0;
+    recomputed_atoms_sum_ = 0.0;
+    error_checks_ = 0;
+    force_error_sum_ = 0.0;
+    force_error_max_ = 0.0;
+    energy_error_max_ = 0.0;
+}
+
+void MD::print_committee_statistics(){
+    if(committee_.empty()){
+        return;
+    }
+    const RealType mean = committee_evaluations_ > 0 ? force_deviation_sum_ / committee_evaluations_ : 0.0;
+    std::cout << "コミッティの力のばらつき: 平均 " << mean << " eV/Å、最大 " << force_deviation_max_ << " eV/Å、"
+              << "閾値（" << committee_threshold_ << " eV/Å）を超えた構造: " << committee_dumps_ << " 個（" << committee_dump_path_ << "）" << std::endl;
+    force_deviation_sum_ = 0.0;
+    force_deviation_max_ = 0.0;
+    committee_evaluations_ = 0;
+    committee_dumps_ = 0;
 }
 
 void MD::reset_step() {
@@ -560,134 +753,247 @@ void MD::set_traj_path(const std::string& path) {
     traj_path_ = path;
 }
 
-//=====LJユニットによるテスト用関数=====
-//NVEの1ステップ
-void MD::step_LJ(torch::Tensor& box) {
-    atoms_.velocities_update(dt_);      //速度の更新（1回目）
-    atoms_.positions_update(dt_, box);  //位置の更新
-    NL_.update(atoms_);                 //NLの確認と更新
-    LJ::calc_energy_and_force(atoms_, NL_); //力の更新
-    atoms_.velocities_update(dt_);      //速度の更新（2回目）
+void MD::set_NL_method(const std::string& method, const IntType cell_threshold) {
+    NL_.set_method(method);
+    NL_.set_cell_threshold(cell_threshold);
 }
 
-//NVTの1ステップ（Nose-Hoover）
-void MD::step_LJ(torch::Tensor& box, NoseHooverThermostat& Thermostat) {
-    Thermostat.update(atoms_, dt_);     //熱浴の更新
-    step_LJ(box);
-    Thermostat.update(atoms_, dt_);     //熱浴の更新
+void MD::set_NL_half(const bool half) {
+    NL_.set_half(half);
 }
 
-//NVTの1ステップ（Bussi）
-void MD::step_LJ(torch::Tensor& box, BussiThermostat& Thermostat) {
-    step_LJ(box);
-    Thermostat.update(atoms_, dt_);     //熱浴の更新
+void MD::set_NL_pair_cutoffs(const std::string& spec) {
+    NL_.set_pair_cutoffs(NeighbourList::parse_pair_cutoffs(spec));
 }
 
-template <typename OutputAction>
-void MD::NVE_loop_LJ(const RealType tsim, const RealType temp, OutputAction output_action) {
-    torch::TensorOptions options = torch::TensorOptions().device(device_);
+void MD::set_NL_block_size(const IntType block_size) {
+    NL_.set_block_size(block_size);
+}
 
-    //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)" << std::endl;
+void MD::set_NL_sort_by_distance(const bool sort_by_distance) {
+    NL_.set_sort_by_distance(sort_by_distance);
+}
 
-    //NLの作成
-    NL_.generate(atoms_);
+void MD::set_NL_auto_margin(const bool auto_margin, const RealType margin_min, const RealType margin_max) {
+    NL_.set_auto_margin(auto_margin, margin_min, margin_max);
+}
 
-    //モデルの推論
-    LJ::calc_energy_and_force(atoms_, NL_);
+void MD::optimize_model(const std::string& cache_dir) {
+    if(model_backend_ != "torchscript") {
+        std::cout << "バックエンドが" << model_backend_ << "のため、モデルの最適化は行いません。" << std::endl;
+        return;
+    }
 
-    IntType steps = tsim / dt_real_;    //総ステップ数
-    steps += t_;
-    print_energies();
+    //隣接リストの構築はモデルの読み込みと並行して行い、最適化の時間には含めない
+    NL_.generate(atoms_);
+    wait_for_model();
+    if(!model_.loaded()) {
+        throw std::runtime_error("モデルが読み込まれていません。");
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    //最適化の前後で、現在の構造に対する推論の時間と力を比べる
+    const double before = inference::benchmark_forward(model_, atoms_, NL_, graph_);
+    torch::Tensor x, edge_index, edge_weight;
+    std::tie(x, edge_index, edge_weight) = graph_.build(atoms_, NL_);
+    const torch::Tensor reference_forces = model_.forward(x, edge_index, edge_weight).second.to(torch::kFloat64);
+    const Model original = model_;
+
+    //optimize_for_inferenceで推論できない、または力が変わる場合（forwardの中で微分するモデルなど）は、freezeのみにする
+    bool optimized = false;
+    for(const bool freeze_only : {false, true}) {
+        try {
+            model_.set_module(inference::load_optimized_model(model_.path(), device_, cache_dir, freeze_only));
+            const torch::Tensor forces = model_.forward(x, edge_index, edge_weight).second.to(torch::kFloat64);
+            const double force_error = (forces - reference_forces).abs().max().item<double>();
+            const double force_scale = reference_forces.abs().max().item<double>();
+            if(force_error <= 1e-4 * std::max(force_scale, 1.0)) {
+                optimized = true;
+                std::cout << "最適化の方法: " << (freeze_only ? "freezeのみ" : "freeze + optimize_for_inference") << "（力の最大誤差: " << force_error << " eV/Å）" << std::endl;
+                break;
+            }
+            std::cerr << (freeze_only ? "freeze" : "optimize_for_inference") << "で力が変わったため（最大誤差: " << force_error << " eV/Å）、使いません。" << std::endl;
+        }
+        catch(const std::exception& e) {
+            std::cerr << (freeze_only ? "freeze" : "optimize_for_inference") << "したモデルで推論できないため、使いません。" << std::endl
+                      << e.what() << std::endl;
+        }
+        model_ = original;
+    }
+    if(!optimized) {
+        std::cout << "最適化せずに元のモデルを使います。" << std::endl;
+        return;
+    }
 
-    while(t_ < steps){
-        step_LJ(box_);
+    const double after = inference::benchmark_forward(model_, atoms_, NL_, graph_);
+    model_preparation_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "1回の推論にかかる時間: " << before << " ms → " << after << " ms" << std::endl;
+}
 
-        t_ ++;
+void MD::quantize_model() {
+    if(model_backend_ != "torchscript" || !device_.is_cpu()) {
+        std::cout << "int8量子化は、CPUかつバックエンドがtorchscriptの場合のみ行います。" << std::endl;
+        return;
+    }
 
-        //出力
-        output_action();
+    if(autograd_force_) {
+        std::cout << "エネルギーの微分から力を求める設定のため、int8量子化は行いません（量子化した線形層は微分できません）。" << std::endl;
+        return;
     }
-}
 
-template <typename OutputAction, typename ThermostatType>
-void MD::NVT_loop_LJ(const RealType tsim, ThermostatType& Thermostat, OutputAction output_action) {
-    torch::TensorOptions options = torch::TensorOptions().device(device_);
+    //隣接リストの構築はモデルの読み込みと並行して行い、量子化の時間には含めない
+    NL_.generate(atoms_);
+    wait_for_model();
+    if(!model_.supports_inference_mode()) {
+        std::cout << "モデルがforwardの中で力を微分して求めるため、int8量子化は行いません（量子化した線形層は微分できません）。" << std::endl;
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
 
-    Thermostat.setup(atoms_);
+    IntType num_quantized = 0;
+    Model quantized = model_;
+    quantized.set_module(inference::quantize_dynamic_int8(model_.module(), num_quantized));
+    std::cout << "線形層をint8に量子化しました: " << num_quantized << " 層" << std::endl;
 
-    //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << std::endl;
+    //初期構造で、floatのモデルとの誤差を確認する
+    inference::print_accuracy_report(model_, quantized, atoms_, NL_, graph_);
 
-    //NLの作成
-    NL_.generate(atoms_);
+    model_ = quantized;
+    model_preparation_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-    //モデルの推論
-    LJ::calc_energy_and_force(atoms_, NL_);
+double MD::wait_for_model() {
+    if(!model_future_.valid()) {
+        return 0.0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    model_ = model_future_.get();
+    const double wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    model_wait_time_ += wait;
+    return wait;
+}
 
-    IntType steps = tsim / dt_real_;    //総ステップ数
-    steps += t_;
-    print_energies();
+void MD::warm_up(const IntType num_forwards) {
+    //最初の隣接リストの構築（モデルの読み込みと並行して行う）
+    NL_.generate(atoms_);
 
-    while(t_ < steps){
-        step_LJ(box_, Thermostat);
-        t_ ++;
+    //モデルの読み込みを待つ（最適化・量子化ですでに待っていれば、その時間を含めて出力する）
+    wait_for_model();
+    const double startup = std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_begin_).count();
+
+    //ウォームアップ（最初の数回はTorchScriptのプロファイリングのため遅い）
+    //力とポテンシャルは現在の構造に対するものなので、上書きしても結果は変わらない
+    //コミッティのモデルも推論されるが、同じ構造を何度も保存しないようにする
+    auto start = std::chrono::steady_clock::now();
+    committee_dump_ = false;
+    for(IntType i = 0; i < num_forwards; i++) {
+        calc_energy_and_force();
+        atoms_.potential_energy().item<RealType>();     //CUDAでも推論の終了を待つ
+    }
+    committee_dump_ = true;
+    const double warm_up_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    //ウォームアップの推論はコミッティ・差分推論の統計に含めない
+    force_deviation_sum_ = 0.0;
+    force_deviation_max_ = 0.0;
+    committee_evaluations_ = 0;
+    full_evaluations_ = 0;
+    incremental_evaluations_ = 0;
+    recomputed_atoms_sum_ = 0.0;
+    error_checks_ = 0;
+    force_error_sum_ = 0.0;
+    force_error_max_ = 0.0;
+    energy_error_max_ = 0.0;
+
+    std::cout << "起動から最初のステップの準備まで: " << startup << " s（うちモデルの読み込み待ち: " << model_wait_time_ << " s、"
+              << "モデルの最適化・量子化: " << model_preparation_time_ << " s、その他: " << startup - model_wait_time_ - model_preparation_time_ << " s）" << std::endl
+              << "ウォームアップ: " << num_forwards << " 回、" << warm_up_time << " s" << std::endl
+              << "InferenceMode: " << (model_.supports_inference_mode() ? "使用" : "不使用（モデルがforwardの中で微分するため）") << std::endl;
+}
 
-        //出力
-        output_action();
+void MD::set_edge_padding(const bool padding) {
+    graph_.set_padding(padding);
+    //差分推論の部分グラフは大きさが毎ステップ変わるため、同じ設定でバケットに切り上げる
+    incremental_graph_.set_padding(padding);
+}
 
-        //ドリフト速度の除去
-        if(!(t_ & 127)) { 
-            atoms_.remove_drift();
-        }
+void MD::set_incremental(const RealType tolerance, const IntType interval, const IntType hops) {
+    if(tolerance > 0 && (interval < 1 || hops < 0)) {
+        throw std::invalid_argument("差分推論の間隔は1以上、ホップ数は0以上である必要があります。");
     }
+    incremental_tolerance_ = tolerance;
+    incremental_interval_ = interval;
+    incremental_hops_ = hops;
+    //次の推論で全体を推論し直す
+    reference_positions_ = torch::Tensor();
+    incremental_moved_ = torch::Tensor();
+    steps_since_full_ = 0;
 }
 
-template <typename OutputAction, typename ThermostatType>
-void MD::NVT_anneal_loop_LJ(const RealType cooling_rate, ThermostatType& Thermostat, const RealType targ_temp, OutputAction output_action) {
-    torch::TensorOptions options = torch::TensorOptions().device(device_);
+void MD::set_autograd_force(const bool autograd_force) {
+    autograd_force_ = autograd_force;
+}
 
-    Thermostat.setup(atoms_);
+void MD::set_force_provider(std::unique_ptr<ForceProvider> provider) {
+    force_provider_ = std::move(provider);
+}
 
-    //NLの作成
-    NL_.generate(atoms_);
+void MD::set_frozen(const torch::Tensor& frozen, const IntType subgraph_hops) {
+    atoms_.set_frozen(frozen);
+    //固定原子がなければ、部分グラフも使わない
+    const torch::Tensor& frozen_atoms = atoms_.frozen();
+    graph_.set_subgraph(frozen_atoms.defined() ? frozen_atoms.logical_not() : torch::Tensor(), subgraph_hops);
+}
 
-    //モデルの推論
-    LJ::calc_energy_and_force(atoms_, NL_);
+void MD::set_committee(const std::vector<std::string>& model_paths, const RealType threshold, const std::string& dump_path) {
+    if(threshold < 0) {
+        throw std::invalid_argument("コミッティの閾値は0以上である必要があります。");
+    }
+    committee_threshold_ = threshold;
+    committee_dump_path_ = dump_path;
 
-    const RealType dT = cooling_rate * dt_real_;                                            //1ステップあたりの下降温度
-    IntType quench_steps = static_cast<IntType>(std::ceil((temp_ - targ_temp) / dT));       //冷却ステップ数
-    quench_steps += t_;
+    committee_.clear();
+    if(model_paths.empty()) {
+        //コミッティを使わない場合は、モデルの読み込みを待たずに戻る
+        return;
+    }
 
-    //ログの見出しを出力しておく
-    std::cout << "time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << std::endl;
+    //バックエンドはシミュレーションに使うモデルと揃える（コンストラクタで指定したものを使い、読み込みは待たない）
+    for(const std::string& path : model_paths) {
+        committee_.emplace_back(path, device_, model_backend_);
+    }
+}
 
-    print_energies();
+void MD::set_calc_virial(const bool calc_virial) {
+    calc_virial_ = calc_virial;
+}
 
-    //冷却
-    while(t_ < quench_steps){
-        temp_ -= dT;
-        Thermostat.set_temp(temp_);
-        step_LJ(box_, Thermostat);
-        t_ ++;
+void MD::set_NL_speculative(const bool speculative, const RealType extra_margin, const RealType trigger_fraction) {
+    NL_.set_speculative(speculative, extra_margin, trigger_fraction);
+}
 
-        //出力
-        output_action();
+//=====LJユニットによるテスト用関数=====
+//積分・出力はモデルの場合と共通で、力の計算方法だけをLJポテンシャルにする
+void MD::setup_LJ(const std::string& header) {
+    set_force_provider(std::make_unique<LJForceProvider>());
 
-        //ドリフト速度の除去
-        if(!(t_ & 127)) { 
-            atoms_.remove_drift();
-        }
-    }
+    //ログの見出しを出力しておく
+    std::cout << header << std::endl;
 
-    temp_ = targ_temp;
-    Thermostat.set_temp(targ_temp);
+    //NLの作成
+    NL_.generate(atoms_);
+
+    //力の計算
+    calc_energy_and_force();
+    print_energies();
 }
 
 //NVEシミュレーション
 void MD::NVE_LJ(const RealType tsim, const RealType temp, const IntType step, const bool is_save, const std::string output_path) {
+    setup_LJ("time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)");
+
     if(is_save) {
-        NVE_loop_LJ(tsim, temp, [this, step]() {
+        NVE_loop(tsim, temp, [this, step]() {
             if(t_ % step == 0) {
                 print_energies();
 
@@ -697,7 +1003,7 @@ void MD::NVE_LJ(const RealType tsim, const RealType temp, const IntType step, co
         });
     }
     else {
-        NVE_loop_LJ(tsim, temp, [this, step]() {
+        NVE_loop(tsim, temp, [this, step]() {
             if(t_ % step == 0) {
                 print_energies();
             }
@@ -710,8 +1016,11 @@ void MD::NVE_LJ(const RealType tsim, const RealType temp, const IntType step, co
 //NVTシミュレーション
 template <typename ThermostatType>
 void MD::NVT_LJ(const RealType tsim, ThermostatType& Thermostat, const IntType step, const bool is_save, const std::string output_path) {
+    Thermostat.setup(atoms_);
+    setup_LJ("time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)");
+
     if(is_save) {
-        NVT_loop_LJ(tsim, Thermostat, [this, step]() {
+        NVT_loop(tsim, Thermostat, [this, step]() {
             if(t_ % step == 0) {
                 print_energies();
 
@@ -721,7 +1030,7 @@ void MD::NVT_LJ(const RealType tsim, ThermostatType& Thermostat, const IntType s
         });
     }
     else {
-        NVT_loop_LJ(tsim, Thermostat, [this, step]() {
+        NVT_loop(tsim, Thermostat, [this, step]() {
             if(t_ % step == 0) {
                 print_energies();
             }
@@ -738,12 +1047,15 @@ void MD::NVT_LJ(const RealType tsim, ThermostatType& Thermostat, const std::stri
         return; 
     }
 
+    Thermostat.setup(atoms_);
+    setup_LJ("time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)");
+
     const auto logbin = std::pow(10.0, 1.0 / 9);
     int counter = 5;
     auto checker = 1e-3 * std::pow(logbin, counter);
 
     if(is_save) {
-        NVT_loop_LJ(tsim, Thermostat, [this, &checker, logbin]() {
+        NVT_loop(tsim, Thermostat, [this, &checker, logbin]() {
             if(static_cast<double>(dt_real_) * static_cast<double>(t_) > checker) {
                 checker *= logbin;
                 print_energies();
@@ -754,7 +1066,7 @@ void MD::NVT_LJ(const RealType tsim, ThermostatType& Thermostat, const std::stri
         });
     }
     else {
-        NVT_loop_LJ(tsim, Thermostat, [this, &checker, logbin]() {
+        NVT_loop(tsim, Thermostat, [this, &checker, logbin]() {
             if(static_cast<double>(dt_real_) * static_cast<double>(t_) > checker) {
                 checker *= logbin;
                 print_energies();
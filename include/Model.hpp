@@ -0,0 +1,106 @@
+/**
+* @file Model.hpp
+* @brief Modelクラス
+*/
+
+#ifndef MODEL_HPP
+#define MODEL_HPP
+
+#include "config.h"
+
+#include <torch/script.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#ifdef MD_MLP_WITH_AOTI
+#include <torch/csrc/inductor/aoti_package/model_package_loader.h>
+#endif
+
+/**
+ * @brief NNPモデル
+ *
+ * 推論のバックエンドを隠蔽し、グラフからポテンシャルと力を求める共通のインターフェースを提供します。
+ *
+ * - "torchscript": torch::jit::loadで読み込んだTorchScriptのモデル
+ * - "aoti"       : AOTInductorで事前にコンパイルしたモデルのパッケージ（.pt2）
+ *
+ * @note "aoti"を使うには、CMakeのオプションMD_MLP_WITH_AOTIを有効にしてビルドする必要があります。
+ * パッケージは、エッジ数を動的な次元としてエクスポートし、(ポテンシャル, 力)を返すようにしてください。
+ */
+class Model {
+    public:
+        //コンストラクタ
+        Model() = default;
+        /**
+         * @param[in] path モデルのパス
+         * @param[in] device 推論に用いるデバイス
+         * @param[in] backend バックエンド（"torchscript", "aoti"のいずれか）
+         */
+        Model(const std::string& path, const torch::Device& device, const std::string& backend = "torchscript");
+
+        /**
+         * @brief グラフからポテンシャルと力を推論
+         * @return ポテンシャル・力
+         * - `first` (torch::Tensor) ポテンシャル
+         * - `second` (torch::Tensor) それぞれの原子が受ける力 (N, 3)
+         * @param[in] x 原子番号 (N, )
+         * @param[in] edge_index グラフの接続情報 (2, num_edges)
+         * @param[in] edge_weight 接続している原子同士の距離ベクトル (num_edges, 3)
+         * @param[in] inference_mode c10::InferenceModeのもとで推論するか
+         * @param[in] batch 各原子が属する系の番号 (N, )（複数の系をまとめて推論する場合。未定義なら渡さない）
+         * @note batchを渡すと、モデルは系ごとのポテンシャル (num_graphs, )を返します。
+         * forwardの中でtorch.autograd.gradを呼ぶTorchScriptのモデル（力をエネルギーの微分から求めるモデル）は、
+         * inference_modeによらず勾配を有効にして推論し、戻り値を計算グラフから切り離して返します。
+         */
+        std::pair<torch::Tensor, torch::Tensor> forward(const torch::Tensor& x, const torch::Tensor& edge_index, const torch::Tensor& edge_weight, const bool inference_mode = true, const torch::Tensor& batch = torch::Tensor());
+
+        //ゲッタ
+        /**
+         * @brief バックエンドを取得
+         * @return "torchscript", "aoti"のいずれか
+         */
+        const std::string& backend() const { return backend_; }
+        /**
+         * @brief モデルのパスを取得
+         * @return パス
+         */
+        const std::string& path() const { return path_; }
+        /**
+         * @brief モデルが読み込まれているかを取得
+         * @return 読み込まれていればtrue
+         */
+        bool loaded() const { return !path_.empty(); }
+        /**
+         * @brief c10::InferenceModeのもとで推論できるかを取得
+         * @return forwardの中でtorch.autograd.gradを呼ばないモデルならtrue
+         */
+        bool supports_inference_mode() const { return supports_inference_mode_; }
+        /**
+         * @brief TorchScriptのモデルを取得
+         * @return モデル
+         * @note バックエンドが"torchscript"以外の場合は例外を投げます。
+         */
+        torch::jit::script::Module& module();
+
+        //セッタ
+        /**
+         * @brief TorchScriptのモデルを置き換え
+         * @param[in] module 新しいモデル（最適化したものなど）
+         * @note バックエンドが"torchscript"以外の場合は例外を投げます。
+         */
+        void set_module(torch::jit::script::Module module);
+
+    private:
+    std::string path_;                              //モデルのパス
+    std::string backend_ = "torchscript";           //バックエンド
+    torch::jit::script::Module module_;             //TorchScriptのモデル
+    bool supports_inference_mode_ = true;           //InferenceModeのもとで推論できるか（forwardで微分しないか）
+#ifdef MD_MLP_WITH_AOTI
+    std::shared_ptr<torch::inductor::AOTIModelPackageLoader> aoti_;  //AOTInductorのモデル
+#endif
+};
+
+#endif
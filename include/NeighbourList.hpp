@@ -8,6 +8,10 @@
 
 #include "Atoms.hpp"
 
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 class NeighbourList {
@@ -28,12 +32,98 @@ class NeighbourList {
          * @note 戻り値は(num_edges, )のtorch::Tensor
          */
         const torch::Tensor& target_index() const { return target_index_; }
+        /**
+         * @brief CSR形式の行オフセットを取得
+         * 
+         * エッジはソース原子の順に並んでおり、原子iの隣接原子は
+         * target_index()[row_offsets()[i] : row_offsets()[i + 1]]です。
+         * 
+         * @return 行オフセット
+         * @note 戻り値は(N + 1, )のtorch::Tensor
+         */
+        const torch::Tensor& row_offsets() const { return row_offsets_; }
+        /**
+         * @brief CSR形式の列インデックスを取得
+         * @return 列インデックス（target_index()と同じ）
+         * @note 戻り値は(num_edges, )のtorch::Tensor
+         */
+        const torch::Tensor& col_index() const { return target_index_; }
+        /**
+         * @brief ビューの半径を取得
+         * @param[in] view add_view()で得たビューの番号
+         * @return 半径
+         */
+        RealType view_radius(const IntType view) const { return view_radii_.at(view); }
+        /**
+         * @brief ビューの各行の終端を取得
+         * 
+         * 各行は距離順に並んでいるため、原子iのビュー内の隣接原子は
+         * target_index()[row_offsets()[i] : view_ends(view)[i]]です。
+         * 行の先頭からの区間になっているため、フィルタリングや新たなメモリ確保は必要ありません。
+         * 
+         * @param[in] view add_view()で得たビューの番号
+         * @return 各行の終端
+         * @note 戻り値は(N, )のtorch::Tensor
+         */
+        const torch::Tensor& view_ends(const IntType view) const { return view_ends_.at(view); }
+        /**
+         * @brief 両方向のソース原子のインデックスを取得
+         * 
+         * ハーフリストの場合は (i, j) と (j, i) の両方を含むように展開して返します。
+         * フルリストの場合はsource_index()と同じです。
+         * 
+         * @return ソース原子のインデックス
+         * @note 戻り値は(num_edges, )のtorch::Tensor
+         */
+        torch::Tensor full_source_index() const { return half_ ? torch::cat({source_index_, target_index_}) : source_index_; }
+        /**
+         * @brief 両方向のターゲット原子のインデックスを取得
+         * 
+         * full_source_index()と対応する順番で返します。
+         * 
+         * @return ターゲット原子のインデックス
+         * @note 戻り値は(num_edges, )のtorch::Tensor
+         */
+        torch::Tensor full_target_index() const { return half_ ? torch::cat({target_index_, source_index_}) : target_index_; }
+        /**
+         * @brief ハーフリストかどうかを取得
+         * @return i < jのペアのみを保持している場合はtrue
+         */
+        bool is_half() const { return half_; }
         /**
          * @brief カットオフ距離を取得
          * @return カットオフ距離
          * @note 戻り値は0次元のtorch::Tensor
          */
         const torch::Tensor& cutoff() const { return cutoff_; }
+        /**
+         * @brief 原子種ペアごとのカットオフ距離を取得
+         * @return カットオフ距離の行列。原子番号でインデックス付けします。
+         * @note 戻り値は(Z_max + 1, Z_max + 1)のtorch::Tensor。設定されていない場合は未定義のtorch::Tensorです。
+         */
+        const torch::Tensor& pair_cutoffs() const { return pair_cutoffs_; }
+        /**
+         * @brief 原子種ペアごとのカットオフ距離が設定されているかを取得
+         * @return 設定されていればtrue
+         */
+        bool has_pair_cutoffs() const { return pair_cutoffs_.defined(); }
+        /**
+         * @brief 原子種ペアごとのカットオフ距離を明示的に指定したペアかを取得
+         * @return 指定したペアがtrueの、(Z_max + 1, Z_max + 1)のbool型のtorch::Tensor（指定していないペアの値はcutoff）
+         * @note 設定されていない場合は未定義のtorch::Tensorです。
+         */
+        const torch::Tensor& pair_cutoffs_listed() const { return pair_cutoffs_listed_; }
+        /**
+         * @brief マージンを取得
+         * @return マージン
+         * @note 戻り値は0次元のtorch::Tensor。自動調整が有効な場合は再構築ごとに変化します。
+         */
+        const torch::Tensor& margin() const { return margin_; }
+        /**
+         * @brief マージンの自動調整が有効かを取得
+         * @return 有効ならtrue
+         */
+        bool auto_margin() const { return auto_margin_; }
         /**
          * @brief 前回の原子配置を取得
          * @return カットオフ距離
@@ -45,6 +135,137 @@ class NeighbourList {
          * @return デバイス
          */
         const torch::Device& device() const { return device_; }
+        /**
+         * @brief 隣接リストの構築方法を取得
+         * @return 構築方法（"auto", "dense", "cell", "native"のいずれか）
+         */
+        const std::string& method() const { return method_; }
+        /**
+         * @brief update()による再構築の回数を取得
+         * @return 再構築の回数
+         */
+        IntType num_rebuilds() const { return num_rebuilds_; }
+        /**
+         * @brief 前回の構築から経過したステップ数を取得
+         * @return ステップ数
+         */
+        IntType steps_since_rebuild() const { return steps_since_rebuild_; }
+        /**
+         * @brief 隣接リストの構築ごとに割り当てられる識別番号を取得
+         * @return 識別番号（未構築の場合は0）
+         * @note 構築・デバイスの移動のたびに、すべてのインスタンスを通して一意な値に更新されます。
+         * 隣接リストから作ったデータをキャッシュする際に、リストが変わったかの判定に使えます。
+         */
+        IntType build_id() const { return build_id_; }
+        /**
+         * @brief バックグラウンドで構築した隣接リストに入れ替えた回数を取得
+         * @return 入れ替えの回数
+         */
+        IntType num_speculative_swaps() const { return num_speculative_swaps_; }
+        /**
+         * @brief 投機的な再構築が有効かを取得
+         * @return 有効ならtrue
+         */
+        bool speculative() const { return speculative_; }
+        /**
+         * @brief 再構築の間隔の平均を取得
+         * @return 平均のステップ数（再構築がまだない場合は0）
+         */
+        RealType mean_rebuild_interval() const { return num_rebuilds_ > 0 ? static_cast<RealType>(total_rebuild_interval_) / num_rebuilds_ : 0.0; }
+
+        //セッタ
+        /**
+         * @brief 隣接リストの構築方法を設定
+         * 
+         * - "dense" : 全ペアの距離を計算 (O(N^2))
+         * - "cell"  : セルリストを用いて近傍の27セルのみを探索 (O(N))
+         * - "auto"  : 原子数がcell_thresholdを超えたら"cell"、それ以外は"dense"
+         * - "native": 生の座標配列に対するC++実装（セルリスト + マルチスレッド、CPUで実行）
+         * 
+         * @param[in] method 構築方法
+         * @note "cell"でも、1辺のセル数が3未満になる小さな系では"dense"で構築します。
+         * "native"も同様の場合は全ペアを探索します。
+         */
+        void set_method(const std::string& method);
+        /**
+         * @brief "auto"のときに、セルリストに切り替える原子数を設定
+         * @param[in] cell_threshold 原子数の閾値
+         */
+        void set_cell_threshold(const IntType cell_threshold);
+        /**
+         * @brief ハーフリストにするかを設定
+         * 
+         * trueの場合はi < jのペアのみを保持し、メモリと収集のコストを半分にします。
+         * 両方向のペアが必要な場合はfull_source_index()・full_target_index()を使用してください。
+         * 次回のgenerate()から反映されます。
+         * 
+         * @param[in] half ハーフリストにするか
+         */
+        void set_half(const bool half) { half_ = half; }
+        /**
+         * @brief 全ペアから構築する際のブロックの行数を設定
+         * 
+         * 全ペアの距離を(block_size, N)ずつ計算し、メモリ使用量をO(block_size * N)に抑えます。
+         * 0以下の場合はブロックに分けず、(N, N)を一度に計算します。
+         * 
+         * @param[in] block_size ブロックの行数
+         */
+        void set_block_size(const IntType block_size) { block_size_ = block_size; }
+        /**
+         * @brief 各原子の隣接原子を距離の近い順に並べるかを設定
+         * 
+         * 次回のgenerate()から反映されます。
+         * 
+         * @param[in] sort_by_distance 距離順に並べるか
+         */
+        void set_sort_by_distance(const bool sort_by_distance) { sort_by_distance_ = sort_by_distance; }
+        /**
+         * @brief 原子種ペアごとのカットオフ距離を設定
+         * 
+         * 各ペア(i, j)について、pair_cutoffs[Z_i][Z_j] + marginより近いペアのみを隣接リストに含めます。
+         * セルの大きさはcutoff + marginで決まるため、すべての値はcutoff以下である必要があります。
+         * NaNの要素は指定していないペアとみなし、cutoffを用います（pair_cutoffs_listed()でfalseになります）。
+         * 
+         * @param[in] pair_cutoffs 原子番号でインデックス付けした、対称なカットオフ距離の行列
+         */
+        void set_pair_cutoffs(const torch::Tensor& pair_cutoffs);
+        /**
+         * @brief マージンの自動調整を設定
+         * 
+         * 有効な場合、再構築のたびに
+         * (再構築の時間) / (再構築の間隔) + (1エッジあたりのグラフ構築時間) × (エッジ数)
+         * が最小となるマージンを[margin_min, margin_max]の範囲で探し、次の隣接リストに適用します。
+         * 再構築の間隔はマージンに比例、エッジ数は(cutoff + margin)^3に比例すると仮定しています。
+         * 急激な変化を避けるため、1回の調整での変化は0.8倍から1.25倍までに制限します。
+         * 
+         * @param[in] auto_margin 自動調整を行うか
+         * @param[in] margin_min マージンの下限
+         * @param[in] margin_max マージンの上限
+         */
+        void set_auto_margin(const bool auto_margin, const RealType margin_min, const RealType margin_max);
+        /**
+         * @brief 投機的な再構築を設定
+         * 
+         * 変位の和がマージンのtrigger_fraction倍を超えたら、その時点の配置から
+         * マージンをextra_marginだけ広げた隣接リストをバックグラウンドのスレッドで構築します。
+         * マージンを超えたときには、構築済みの隣接リストがその時点の配置に対して有効であれば入れ替え、
+         * 有効でなければその場で構築し直します。
+         * 
+         * @param[in] speculative 投機的な再構築を行うか
+         * @param[in] extra_margin 追加のマージン (Å)
+         * @param[in] trigger_fraction バックグラウンドでの構築を始める、変位の和とマージンの比 (0, 1)
+         * @note update(atoms)でのみ有効です。投機的な再構築ではマージンの自動調整は行いません。
+         */
+        void set_speculative(const bool speculative, const RealType extra_margin, const RealType trigger_fraction);
+        /**
+         * @brief 1ステップあたりのグラフ構築にかかった時間を記録
+         * 
+         * マージンの自動調整に使用します。モデル以外の力の計算方法（LJなど）では、隣接リストのペアを処理する
+         * 力の計算全体の時間を記録します。記録がないまま再構築した場合は、自動調整を行わずに警告を1度出します。
+         * 
+         * @param[in] seconds 隣接リストからグラフを構築するのにかかった時間 (s)
+         */
+        void record_graph_time(const double seconds);
 
         //デバイスの移動
         /**
@@ -61,19 +282,188 @@ class NeighbourList {
         void generate(const Atoms& atoms);
 
         //NLの確認
+        /**
+         * @brief 隣接リストの再作成が必要かを判定
+         * 
+         * 変位が最大の2原子をmaxの縮約で求め、その変位の和がmarginを超えているかを判定します。
+         * ソートやホストとの同期は行いません。
+         * 
+         * @param[in] atoms 系
+         * @return 再作成が必要ならtrue
+         * @note 戻り値はデバイス上の0次元のbool型torch::Tensorです。他の判定とまとめて同期できます。
+         */
+        torch::Tensor needs_rebuild(const Atoms& atoms) const;
         /**
          * @brief 隣接リストを確認し、必要があれば再作成
          * @param[in] atoms 系
          */
         void update(const Atoms& atoms);
+        /**
+         * @brief needs_rebuild()の結果をもとに、必要があれば隣接リストを再作成
+         * @param[in] atoms 系
+         * @param[in] rebuild 再作成するか（ホストに同期済みのneeds_rebuild()の結果）
+         */
+        void update(const Atoms& atoms, const bool rebuild);
+
+        //ビュー
+        /**
+         * @brief 半径の異なるビューを追加
+         * 
+         * 隣接リストはcutoffとすべてのビューの半径の最大値で1回だけ構築し、各行を距離順に並べます。
+         * 半径radiusのビューは、各行の先頭から半径radius + margin以内の部分です。
+         * 他の隣接リストと同様に、実際の距離でのフィルタリングは使用する側で行ってください。
+         * 次回のgenerate()から反映されます。
+         * 
+         * @param[in] radius ビューの半径
+         * @return ビューの番号
+         * @note 原子種ペアごとのカットオフ距離を設定している場合、それを超えるペアはビューにも含まれません。
+         */
+        IntType add_view(const RealType radius);
+        /**
+         * @brief ビューに含まれるエッジをCOO形式で取得
+         * 
+         * TorchScriptのモデルなど、COO形式のエッジが必要な場合に使用します。新たにメモリを確保します。
+         * 
+         * @param[in] view add_view()で得たビューの番号
+         * @return ソース原子とターゲット原子のインデックス
+         */
+        std::pair<torch::Tensor, torch::Tensor> view_edges(const IntType view) const;
+
+        //CSR
+        /**
+         * @brief ソース原子の順に並んだエッジから、CSR形式の行オフセットを作成
+         * 
+         * 隣接リストをマスクでフィルタリングした後のエッジなど、ソース原子の順に並んだエッジに使用できます。
+         * 
+         * @param[in] sorted_source ソース原子の順に並んだソース原子のインデックス (num_edges, )
+         * @param[in] num_atoms 原子数
+         * @return 行オフセット (num_atoms + 1, )
+         */
+        static torch::Tensor make_row_offsets(const torch::Tensor& sorted_source, const IntType num_atoms);
+
+        /**
+         * @brief 文字列から原子種ペアごとのカットオフ距離の行列を作成
+         * 
+         * "Si-O:2.3,Na-O:3.0"のように、元素記号のペアとカットオフ距離をカンマ区切りで指定します。
+         * 指定していないペアはNaNにします（set_pair_cutoffs()でcutoffに置き換えられ、指定していないペアとして記録されます）。
+         * 
+         * @param[in] spec ペアごとのカットオフ距離の指定
+         * @return (Z_max + 1, Z_max + 1)のカットオフ距離の行列
+         */
+        static torch::Tensor parse_pair_cutoffs(const std::string& spec);
+        /**
+         * @brief 再構築の回数・間隔の統計をリセット
+         */
+        void reset_statistics();
 
     private:
+        /**
+         * @brief 全ペアの距離から隣接リストを作成
+         * 
+         * block_size_行ずつ処理し、結果を結合します。得られるペアとその並び順はブロックの大きさによりません。
+         * 
+         * @param[in] pos 位置ベクトル (N, 3)
+         * @param[in] Lbox シミュレーションボックスの大きさ
+         */
+        void generate_dense(const torch::Tensor& pos, const torch::Tensor& Lbox);
+        /**
+         * @brief セルリストを用いて隣接リストを作成
+         * 
+         * 1辺がcutoff + margin以上のセルに原子を振り分け、隣接する27セルの原子のみを探索します。
+         * 得られるペアとその並び順はgenerate_denseと同一です。
+         * 
+         * @param[in] pos 位置ベクトル (N, 3)
+         * @param[in] Lbox シミュレーションボックスの大きさ
+         * @param[in] n_cells 1辺あたりのセル数（3以上）
+         */
+        void generate_cell(const torch::Tensor& pos, const torch::Tensor& Lbox, const IntType n_cells);
+        /**
+         * @brief CPU上のC++実装で隣接リストを作成
+         * 
+         * torchの演算を介さずに座標の配列を直接走査し、at::parallel_forで原子ごとに並列化します。
+         * 1回目の走査で各原子の隣接原子数を数え、確保したtorch::Tensorに2回目の走査で直接書き込みます。
+         * 得られるペアとその並び順はgenerate_denseと同一です。
+         * 
+         * @param[in] pos 位置ベクトル (N, 3)
+         * @param[in] Lbox シミュレーションボックスの大きさ
+         * @note デバイスがCPU以外の場合は、CPUで構築してから結果をデバイスに移動します。
+         */
+        void generate_native(const torch::Tensor& pos, const torch::Tensor& Lbox);
+        /**
+         * @brief 作成したエッジからCSR形式の行オフセットを作成
+         * 
+         * sort_by_distance_がtrueの場合は、各行の中を距離の近い順に並べ替えます。
+         * 
+         * @param[in] pos 位置ベクトル (N, 3)
+         * @param[in] Lbox シミュレーションボックスの大きさ
+         */
+        void build_csr(const torch::Tensor& pos, const torch::Tensor& Lbox);
+        /**
+         * @brief 隣接リストを構築する半径を取得
+         * @return cutoffとビューの半径の最大値（0次元のtorch::Tensor）
+         */
+        torch::Tensor list_cutoff() const;
+        /**
+         * @brief 計測した時間をもとにマージンを調整
+         */
+        void tune_margin();
+        /**
+         * @brief 前回の構築からの変位が最大の2原子について、変位の和を計算
+         * @param[in] atoms 原子の情報
+         * @return 変位の和（0次元のtorch::Tensor）
+         */
+        torch::Tensor max_displacement(const Atoms& atoms) const;
+        /**
+         * @brief 現在の配置のスナップショットから、バックグラウンドで隣接リストの構築を開始
+         * @param[in] atoms 原子の情報
+         */
+        void launch_speculative(const Atoms& atoms);
+        /**
+         * @brief バックグラウンドで構築した隣接リストに入れ替え
+         * @param[in] atoms 原子の情報
+         * @return 入れ替えた場合はtrue、構築中のものがないか現在の配置に対して無効な場合はfalse
+         */
+        bool swap_speculative(const Atoms& atoms);
+
     torch::Tensor source_index_;                     //ソース原子のインデックス (num_edges, )
     torch::Tensor target_index_;                     //ターゲット原子のインデックス (num_edges, )
+    torch::Tensor row_offsets_;                      //CSR形式の行オフセット (N + 1, )
     torch::Tensor NL_config_;                        //隣接リスト構築時点での配置を保存しておく配列
     torch::Tensor cutoff_;                           //カットオフ距離 (1, )
     torch::Tensor margin_;                           //カットオフからのマージン (1, )
+    torch::Tensor pair_cutoffs_;                     //原子種ペアごとのカットオフ距離 (Z_max + 1, Z_max + 1)
+    torch::Tensor pair_cutoffs_listed_;              //カットオフ距離を明示的に指定したペアか (Z_max + 1, Z_max + 1)
+    torch::Tensor atomic_numbers_;                   //隣接リスト構築時点での原子番号 (N, )
     torch::Device device_;
+    std::string method_ = "auto";                    //構築方法
+    IntType cell_threshold_ = 5000;                  //"auto"のときにセルリストを使う原子数
+    bool half_ = false;                              //i < jのペアのみを保持するか
+    bool sort_by_distance_ = false;                  //各原子の隣接原子を距離順に並べるか
+    std::vector<RealType> view_radii_;               //ビューの半径
+    std::vector<torch::Tensor> view_ends_;           //ビューの各行の終端 (N, )
+    IntType block_size_ = 2048;                      //全ペアから構築する際のブロックの行数
+
+    //再構築の統計
+    IntType steps_since_rebuild_ = 0;                //前回の構築からのステップ数
+    IntType num_rebuilds_ = 0;                       //update()による再構築の回数
+    IntType total_rebuild_interval_ = 0;             //再構築の間隔の合計
+    IntType build_id_ = 0;                           //構築ごとの識別番号
+
+    //マージンの自動調整
+    bool auto_margin_ = false;                       //自動調整を行うか
+    RealType margin_min_ = 0.3;                      //マージンの下限
+    RealType margin_max_ = 3.0;                      //マージンの上限
+    double generate_time_ = 0.0;                     //1回の構築にかかる時間の移動平均 (s)
+    double graph_time_ = 0.0;                        //1ステップのグラフ構築にかかる時間の移動平均 (s)
+    bool graph_time_warned_ = false;                 //グラフ構築の時間の記録がないことを警告したか
+
+    //投機的な再構築
+    bool speculative_ = false;                       //投機的な再構築を行うか
+    RealType speculative_extra_margin_ = 0.5;        //追加のマージン
+    RealType speculative_trigger_ = 0.7;             //構築を始める変位の和とマージンの比
+    RealType extra_margin_applied_ = 0.0;            //現在のリストに適用されている追加のマージン
+    std::shared_ptr<std::future<NeighbourList>> pending_;  //バックグラウンドで構築中の隣接リスト
+    IntType num_speculative_swaps_ = 0;              //入れ替えた回数
 };
 
 #endif
\ No newline at end of file
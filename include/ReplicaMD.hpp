@@ -0,0 +1,198 @@
+/**
+* @file ReplicaMD.hpp
+* @brief ReplicaMDクラス
+*/
+
+#ifndef REPLICA_MD_HPP
+#define REPLICA_MD_HPP
+
+#include "Atoms.hpp"
+#include "NeighbourList.hpp"
+#include "GraphWorkspace.hpp"
+#include "Model.hpp"
+#include "config.h"
+#include "NoseHooverThermostat.hpp"
+#include "BussiThermostat.hpp"
+
+#include <torch/script.h>
+#include <torch/torch.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief 独立な複数のレプリカを、1つのモデルでまとめて推論するMD
+ *
+ * 各レプリカは自分の原子・隣接リスト・熱浴を持ちます。毎ステップ、K個のレプリカのグラフを
+ * エッジのインデックスをずらして1つの非連結なグラフに結合し、1回のforwardで推論してから、
+ * ポテンシャルと力を各レプリカに振り分けます。
+ *
+ * 各原子が属するレプリカの番号をbatchとしてモデルに渡すため、batchを受け取るモデルはレプリカごとのポテンシャルを返します。
+ *
+ * @note batchを受け取らず、ポテンシャルが系全体の1つの値のモデルの場合は、各レプリカのポテンシャルに分けられないため、
+ * 出力するステップでのみレプリカごとに推論し直してポテンシャルを求めます（力は結合したグラフの値をそのまま使います）。
+ */
+class ReplicaMD {
+    public:
+        //コンストラクタ
+        /**
+         * @param[in] num_replicas レプリカの数
+         * @param[in] dt 時間刻み幅 (fs)
+         * @param[in] cutoff カットオフ距離 (Å)
+         * @param[in] margin 隣接リストのマージン (Å)
+         * @param[in] data_paths 初期構造のパス（1つならすべてのレプリカで共通、レプリカの数だけあればレプリカごと）
+         * @param[in] model_path モデルのパス
+         * @param[in] device デバイス
+         * @param[in] model_backend モデルのバックエンド
+         * @note レプリカは非連結なグラフとしてまとめるため、原子数や系の大きさはレプリカごとに異なっていても構いません。
+         */
+        ReplicaMD(const IntType num_replicas, RealType dt, RealType cutoff, RealType margin, const std::vector<std::string>& data_paths, const std::string& model_path, torch::Device device = torch::kCPU, const std::string& model_backend = "torchscript");
+
+        /**
+         * @brief NVTシミュレーションの実行
+         * @param[in] tsim シミュレーション時間 (fs)
+         * @param[in] Thermostats レプリカごとの熱浴
+         * @param[in] step 何ステップごとに出力するか
+         * @param[in] is_save 各ステップごとにtrajectoryを保存するか
+         * @note 熱浴に、あらかじめ目標温度を設定しておいてください。
+         */
+        template <typename ThermostatType>
+        void NVT(const RealType tsim, std::vector<ThermostatType>& Thermostats, const IntType step, const bool is_save = false);
+        /**
+         * @brief NVTシミュレーションの実行
+         * @param[in] tsim シミュレーション時間 (fs)
+         * @param[in] Thermostats レプリカごとの熱浴
+         * @param[in] log その他の保存方法（現在はlogスケールのみ）
+         * @param[in] is_save 各ステップごとにtrajectoryを保存するか
+         * @note 熱浴に、あらかじめ目標温度を設定しておいてください。
+         */
+        template <typename ThermostatType>
+        void NVT(const RealType tsim, std::vector<ThermostatType>& Thermostats, const std::string log, const bool is_save = false);
+
+        /**
+         * @brief 温度をもとに、各レプリカの原子の速度を独立に初期化
+         * @param[in] initial_temp 温度 (K)
+         */
+        void init_temp(const RealType initial_temp);
+        /**
+         * @brief ステップ数を0に戻す
+         */
+        void reset_step() { t_ = 0; }
+        /**
+         * @brief 各レプリカの系を保存
+         * @param[in] save_path 保存するパス（拡張子の前にレプリカの番号を付けます）
+         */
+        void save_atoms(const std::string& save_path);
+        /**
+         * @brief trajectoryファイルの保存先を変更
+         * @param[in] path 保存先（拡張子の前にレプリカの番号を付けます）
+         */
+        void set_traj_path(const std::string& path) { traj_path_ = path; }
+        /**
+         * @brief すべてのレプリカの隣接リストの設定を変更
+         * @param[in] configure 隣接リストを受け取って設定する関数
+         */
+        void configure_NL(const std::function<void(NeighbourList&)>& configure);
+        /**
+         * @brief モデルに入力するエッジ数のパディングを変更
+         * @param[in] padding 各レプリカのエッジ数をバケットの大きさに切り上げ、ダミーのエッジで埋めるか
+         */
+        void set_edge_padding(const bool padding);
+        /**
+         * @brief 隣接リストの再構築の回数・平均間隔をレプリカごとに出力し、統計をリセット
+         */
+        void print_NL_statistics();
+
+        /**
+         * @brief レプリカの数を取得
+         * @return レプリカの数
+         */
+        IntType num_replicas() const { return static_cast<IntType>(atoms_.size()); }
+        /**
+         * @brief 現在の運動温度を取得
+         * @param[in] replica レプリカの番号
+         */
+        RealType kinetic_temperature(const IntType replica) const {
+            return atoms_[replica].temperature().item<RealType>();
+        }
+        /**
+         * @brief パスの拡張子の前にレプリカの番号を付ける
+         * @return "traj.xyz" -> "traj_0.xyz"のようなパス
+         * @param[in] path パス
+         * @param[in] replica レプリカの番号
+         */
+        static std::string replica_path(const std::string& path, const IntType replica);
+
+    private:
+        /**
+         * @brief すべてのレプリカのポテンシャルと力を、1回の推論でまとめて計算
+         */
+        void calc_energy_and_force();
+        /**
+         * @brief 全レプリカの隣接リストを確認し、必要があれば再作成
+         * @note 再作成の判定はまとめてホストに同期するため、同期はレプリカの数によらず1ステップに1回です。
+         */
+        void update_NLs();
+        /**
+         * @brief 全レプリカのNVTシミュレーションを1ステップ行う
+         * @param[in] Thermostats レプリカごとの熱浴
+         */
+        template <typename ThermostatType>
+        void step(std::vector<ThermostatType>& Thermostats);
+        /**
+         * @brief NVTシミュレーションのメインループ
+         * @param[in] tsim シミュレーション時間 (fs)
+         * @param[in] Thermostats レプリカごとの熱浴
+         * @param[in] output_action 出力関数
+         */
+        template <typename OutputAction, typename ThermostatType>
+        void NVT_loop(const RealType tsim, std::vector<ThermostatType>& Thermostats, OutputAction output_action);
+        /**
+         * @brief NVTシミュレーションの準備（隣接リストの作成・熱浴の設定・最初の推論・見出しの出力）
+         * @param[in] Thermostats レプリカごとの熱浴
+         */
+        template <typename ThermostatType>
+        void NVT_setup(std::vector<ThermostatType>& Thermostats);
+        /**
+         * @brief レプリカごとに経過時間・運動エネルギー・ポテンシャルエネルギー・全エネルギー・温度を出力
+         */
+        void print_energies();
+        /**
+         * @brief 各レプリカのtrajectoryを保存
+         */
+        void save_trajectories();
+
+        //熱浴の前半・後半の更新（MD::stepと同じ順序）
+        void thermostat_before(NoseHooverThermostat& Thermostat, Atoms& atoms) { Thermostat.update(atoms, dt_); }
+        void thermostat_before(BussiThermostat&, Atoms&) {}
+        template <typename ThermostatType>
+        void thermostat_after(ThermostatType& Thermostat, Atoms& atoms) { Thermostat.update(atoms, dt_); }
+
+        //シミュレーション用
+        IntType t_ = 0;                                                 //現在のステップ数
+        torch::Tensor dt_;                                              //時間刻み幅
+        RealType dt_real_;
+        std::string traj_path_ = "./trajectory.xyz";                    //trajectoryを保存するパス
+
+        //モデル
+        Model model_;                                                   //全レプリカで共通のモデル
+        bool energies_per_replica_ = true;                              //推論したポテンシャルをレプリカごとに分けられたか
+
+        //レプリカごとの状態
+        std::vector<Atoms> atoms_;                                      //原子
+        std::vector<NeighbourList> NLs_;                                //隣接リスト
+        std::vector<GraphWorkspace> graphs_;                            //グラフ構築の作業領域
+        std::vector<torch::Tensor> boxes_;                              //何個目の箱のミラーに位置しているか (N, 3)
+
+        //シミュレーションデバイス
+        torch::Device device_;
+
+        //定数
+        torch::Tensor boltzmann_constant_;
+        torch::Tensor conversion_factor_;
+};
+
+#include "ReplicaMD.tpp"
+
+#endif
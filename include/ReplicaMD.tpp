@@ -0,0 +1,262 @@
+#include "ReplicaMD.hpp"
+
+#include "xyz.hpp"
+#include "inference.hpp"
+#include "config.h"
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+//=====コンストラクタ=====
+ReplicaMD::ReplicaMD(const IntType num_replicas, RealType dt, RealType cutoff, RealType margin, const std::vector<std::string>& data_paths, const std::string& model_path, torch::Device device, const std::string& model_backend)
+   : dt_(torch::tensor(dt, torch::TensorOptions().device(device).dtype(kRealType))), dt_real_(dt), device_(device)
+{
+    if(num_replicas < 1) {
+        throw std::invalid_argument("レプリカの数は1以上である必要があります。");
+    }
+    if(data_paths.size() != 1 && static_cast<IntType>(data_paths.size()) != num_replicas) {
+        throw std::invalid_argument("初期構造のパスは1つ、またはレプリカの数だけ指定してください。");
+    }
+
+    //モデルの読み込み（全レプリカで共通）
+    model_ = Model(model_path, device, model_backend);
+
+    const torch::Tensor cutoff_tensor = torch::tensor(cutoff, torch::TensorOptions().device(device).dtype(kRealType));
+    const torch::Tensor margin_tensor = torch::tensor(margin, torch::TensorOptions().device(device).dtype(kRealType));
+
+    //レプリカごとに初期構造をロード
+    //Atomsのコピーはtorch::Tensorを共有するため、レプリカごとに読み込む
+    for(IntType k = 0; k < num_replicas; k++) {
+        const std::string& data_path = data_paths.size() == 1 ? data_paths[0] : data_paths[k];
+        Atoms atoms(device);
+        xyz::load_atoms(data_path, atoms, device);
+        atoms.apply_pbc();
+
+        boxes_.push_back(torch::zeros({atoms.size().item<IntType>(), 3}, torch::TensorOptions().dtype(kIntType).device(device_)));
+        atoms_.push_back(atoms);
+        NLs_.emplace_back(cutoff_tensor, margin_tensor, device);
+        graphs_.emplace_back();
+    }
+
+    //使用する定数のデバイスを移動しておく。
+    boltzmann_constant_ = torch::tensor(boltzmann_constant, torch::TensorOptions().dtype(kRealType).device(device_));
+    conversion_factor_ = torch::tensor(conversion_factor, torch::TensorOptions().dtype(kRealType).device(device_));
+}
+
+//=====シミュレーション=====
+template <typename ThermostatType>
+void ReplicaMD::NVT(const RealType tsim, std::vector<ThermostatType>& Thermostats, const IntType step, const bool is_save) {
+    NVT_setup(Thermostats);
+    if (is_save) save_trajectories();
+
+    NVT_loop(tsim, Thermostats, [this, step, is_save]() {
+        if(t_ % step == 0) [[unlikely]] {
+            print_energies();
+            if (is_save) save_trajectories();
+        }
+    });
+}
+
+//NVTシミュレーション（logスケールで保存）
+template <typename ThermostatType>
+void ReplicaMD::NVT(const RealType tsim, std::vector<ThermostatType>& Thermostats, const std::string log, const bool is_save) {
+    if(log != "log") {
+        return;
+    }
+
+    NVT_setup(Thermostats);
+    if (is_save) save_trajectories();
+
+    const auto logbin = std::pow(10.0, 1.0 / 9);
+    auto checker = 1e-3 * std::pow(logbin, 5);
+
+    //現在の時間に合わせてcheckerを更新
+    while (checker <= static_cast<double>(dt_real_) * static_cast<double>(t_)) {
+        checker *= logbin;
+    }
+
+    NVT_loop(tsim, Thermostats, [this, &checker, logbin, is_save]() {
+        if(static_cast<double>(dt_real_) * static_cast<double>(t_) > checker) [[unlikely]] {
+            checker *= logbin;
+            print_energies();
+            if (is_save) save_trajectories();
+        }
+    });
+}
+
+template <typename ThermostatType>
+void ReplicaMD::NVT_setup(std::vector<ThermostatType>& Thermostats) {
+    if(static_cast<IntType>(Thermostats.size()) != num_replicas()) {
+        throw std::invalid_argument("熱浴の数がレプリカの数と一致しません。");
+    }
+
+    //NLの作成と熱浴の設定
+    for(IntType k = 0; k < num_replicas(); k++) {
+        NLs_[k].generate(atoms_[k]);
+        Thermostats[k].setup(atoms_[k]);
+    }
+
+    //モデルの推論
+    calc_energy_and_force();
+
+    //ログの見出しを出力しておく
+    std::cout << "replica、time (fs)、kinetic energy (eV)、potential energy (eV)、total energy (eV)、temperature (K)" << std::endl;
+    print_energies();
+}
+
+//=====シミュレーション（1ステップ）=====
+template <typename ThermostatType>
+void ReplicaMD::step(std::vector<ThermostatType>& Thermostats) {
+    for(IntType k = 0; k < num_replicas(); k++) {
+        thermostat_before(Thermostats[k], atoms_[k]);   //熱浴の更新
+        atoms_[k].velocities_update(dt_);               //速度の更新（1回目）
+        atoms_[k].positions_update(dt_, boxes_[k]);     //位置の更新
+    }
+
+    update_NLs();                                       //NLの確認と更新（全レプリカの判定をまとめて同期）
+    calc_energy_and_force();                            //力の更新（全レプリカをまとめて推論）
+
+    for(IntType k = 0; k < num_replicas(); k++) {
+        atoms_[k].velocities_update(dt_);               //速度の更新（2回目）
+        thermostat_after(Thermostats[k], atoms_[k]);    //熱浴の更新
+    }
+}
+
+//=====シミュレーション（メインループ）=====
+template <typename OutputAction, typename ThermostatType>
+void ReplicaMD::NVT_loop(const RealType tsim, std::vector<ThermostatType>& Thermostats, OutputAction output_action) {
+    IntType steps = tsim / dt_real_;    //総ステップ数
+    steps += t_;
+
+    while(t_ < steps){
+        step(Thermostats);
+        t_ ++;
+
+        //出力
+        output_action();
+
+        //ドリフト速度の除去
+        if(!(t_ & 127)) {
+            for(auto& atoms : atoms_) {
+                atoms.remove_drift();
+            }
+        }
+    }
+}
+
+//=====力の計算=====
+void ReplicaMD::calc_energy_and_force() {
+    energies_per_replica_ = inference::calc_energy_and_force_MLP_batched(model_, atoms_, NLs_, graphs_);
+}
+
+//=====隣接リストの更新=====
+void ReplicaMD::update_NLs() {
+    //全レプリカの再構築の判定をデバイス上でまとめ、ホストへの同期を1ステップに1回にする
+    //投機的な再構築を行う隣接リストは、判定と構築の開始を自分で行うため個別に更新する
+    std::vector<torch::Tensor> flags;
+    std::vector<IntType> replicas;
+    for(IntType k = 0; k < num_replicas(); k++) {
+        if(NLs_[k].speculative()) {
+            NLs_[k].update(atoms_[k]);
+        }
+        else {
+            flags.push_back(NLs_[k].needs_rebuild(atoms_[k]).to(device_));
+            replicas.push_back(k);
+        }
+    }
+    if(flags.empty()) {
+        return;
+    }
+
+    const torch::Tensor rebuild = torch::stack(flags).to(torch::kCPU);
+    const bool* rebuild_ptr = rebuild.data_ptr<bool>();
+    for(size_t i = 0; i < replicas.size(); i++) {
+        NLs_[replicas[i]].update(atoms_[replicas[i]], rebuild_ptr[i]);
+    }
+}
+
+//=====その他=====
+//速度（温度）の初期化
+void ReplicaMD::init_temp(const RealType initial_temp) {
+    for(auto& atoms : atoms_) {
+        //平均0、分散1のランダムな分布を作成（レプリカごとに独立）
+        torch::Tensor velocities = torch::randn({atoms.size().item<int64_t>(), 3}, torch::TensorOptions().device(device_).dtype(kRealType));
+
+        //分散を√(k_B * T / m)にする。
+        torch::Tensor sigma = torch::sqrt((boltzmann_constant_ * initial_temp * conversion_factor_) / atoms.masses());
+        velocities *= sigma.unsqueeze(1);
+
+        //全体速度の除去
+        velocities -= torch::mean(velocities, 0);
+
+        atoms.set_velocities(velocities);
+    }
+}
+
+//エネルギーの出力
+void ReplicaMD::print_energies() {
+    for(IntType k = 0; k < num_replicas(); k++) {
+        //ポテンシャルを結合したグラフから分けられなかった場合は、このレプリカだけで推論し直す
+        if(!energies_per_replica_) {
+            inference::calc_energy_and_force_MLP(model_, atoms_[k], NLs_[k], graphs_[k]);
+        }
+
+        RealType K = atoms_[k].kinetic_energy().item<RealType>();
+        RealType U = atoms_[k].potential_energy().item<RealType>();
+        RealType temperature = atoms_[k].temperature().item<RealType>();
+
+        //レプリカ、時刻、運動エネルギー、ポテンシャルエネルギー、全エネルギー、温度を出力
+        std::cout << k << "," << std::setprecision(15) << std::scientific << dt_real_ * t_ << ","
+                                                                        << K << ","
+                                                                        << U << ","
+                                                                        << K + U << ","
+                                                                        << temperature << std::endl;
+    }
+}
+
+void ReplicaMD::save_trajectories() {
+    for(IntType k = 0; k < num_replicas(); k++) {
+        xyz::save_unwrapped_atoms(replica_path(traj_path_, k), atoms_[k], boxes_[k]);
+    }
+}
+
+void ReplicaMD::save_atoms(const std::string& save_path) {
+    for(IntType k = 0; k < num_replicas(); k++) {
+        xyz::save_atoms(replica_path(save_path, k), atoms_[k]);
+    }
+}
+
+void ReplicaMD::configure_NL(const std::function<void(NeighbourList&)>& configure) {
+    for(auto& NL : NLs_) {
+        configure(NL);
+    }
+}
+
+void ReplicaMD::set_edge_padding(const bool padding) {
+    for(auto& graph : graphs_) {
+        graph.set_padding(padding);
+    }
+}
+
+//隣接リストの統計の出力
+void ReplicaMD::print_NL_statistics() {
+    for(IntType k = 0; k < num_replicas(); k++) {
+        std::cout << "レプリカ" << k << "の隣接リストの再構築: " << NLs_[k].num_rebuilds() << " 回、"
+                  << "平均間隔: " << NLs_[k].mean_rebuild_interval() << " ステップ、"
+                  << "マージン: " << NLs_[k].margin().item<RealType>() << " Å" << std::endl;
+        NLs_[k].reset_statistics();
+    }
+}
+
+std::string ReplicaMD::replica_path(const std::string& path, const IntType replica) {
+    //拡張子の前（拡張子がなければ末尾）にレプリカの番号を付ける
+    const auto slash = path.find_last_of('/');
+    const auto dot = path.find_last_of('.');
+    const bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash) && dot != 0 && path[dot - 1] != '/' && path[dot - 1] != '.';
+    if(!has_extension) {
+        return path + "_" + std::to_string(replica);
+    }
+    return path.substr(0, dot) + "_" + std::to_string(replica) + path.substr(dot);
+}
@@ -0,0 +1,40 @@
+/**
+* @file graph_ops.hpp
+* @brief グラフ構築のための独自の演算子（TorchScriptにも登録）
+*/
+
+#ifndef GRAPH_OPS_HPP
+#define GRAPH_OPS_HPP
+
+#include "config.h"
+
+#include <torch/torch.h>
+
+#include <tuple>
+
+namespace graph_ops{
+    /**
+     * @brief 隣接リストのペアについて、距離ベクトルの計算・最小イメージ規約の適用・カットオフ距離によるフィルタリングを1回で行う
+     *
+     * CPUでは、エッジをスレッドごとの区間に分けて残すエッジを数え、その累積和（プレフィックスサム）から
+     * 書き込み位置を決めて詰めて書き込む、OpenMPで並列化したカーネルを使います。
+     * それ以外のデバイスでは、同じ結果をlibtorchの演算の組み合わせで求めます。
+     *
+     * 演算子md_mlp::radius_filterとして登録しているため、TorchScriptからは
+     * torch.ops.md_mlp.radius_filter(...)として呼び出せます。
+     *
+     * @return 接続情報・距離ベクトル
+     * - `first` (torch::Tensor) グラフの接続情報 (2, num_edges)
+     * - `second` (torch::Tensor) 接続している原子同士の距離ベクトル（ターゲット - ソース） (num_edges, 3)
+     * @param[in] positions 原子の位置 (N, 3)
+     * @param[in] box_size 系の一辺の長さ（0次元）
+     * @param[in] source_index 隣接リストのソース原子 (E, )
+     * @param[in] target_index 隣接リストのターゲット原子 (E, )
+     * @param[in] cutoff2 カットオフ距離の2乗（1要素、またはエッジごとの (E, )）
+     * @param[in] half ハーフリストか（trueなら残したペアを両方向に展開します）
+     * @note 距離の2乗がcutoff2未満のペアを残します。残したペアの順番は隣接リストの順番のままです。
+     */
+    std::tuple<torch::Tensor, torch::Tensor> radius_filter(const torch::Tensor& positions, const torch::Tensor& box_size, const torch::Tensor& source_index, const torch::Tensor& target_index, const torch::Tensor& cutoff2, const bool half);
+}
+
+#endif
@@ -7,11 +7,16 @@
 #define INFERENCE_HPP
 
 #include "Atoms.hpp"
+#include "GraphWorkspace.hpp"
+#include "Model.hpp"
 #include "NeighbourList.hpp"
+#include "config.h"
 
 #include <torch/script.h>
 #include <torch/torch.h>
 
+#include <vector>
+
 namespace inference{
     /**
      * @brief torchscript形式のモデルをロード
@@ -19,6 +24,79 @@ namespace inference{
      * @param[in] model_path モデルのパス
      */
     torch::jit::script::Module load_model(std::string model_path);   
+    /**
+     * @brief モデルを推論用に準備
+     * 
+     * 評価モードへの切り替えなど、推論の前に1度だけ行えばよい処理をまとめて行います。
+     * load_model()の中で呼ばれます。
+     * 
+     * @param[in, out] module モデル
+     */
+    void prepare_model(torch::jit::script::Module& module);
+    /**
+     * @brief モデルのforwardが内部でtorch.autograd.gradを呼ぶかを判定
+     * 
+     * 呼び出すメソッドを展開したforwardのグラフに、aten::gradのノードがあるかを調べます。
+     * 内部でエネルギーを微分して力を求めるモデルは、勾配が無効なc10::InferenceModeのもとでは推論できません。
+     * 
+     * @return aten::gradを呼ぶならtrue
+     * @param[in] module モデル
+     */
+    bool calls_autograd(const torch::jit::script::Module& module);
+    /**
+     * @brief 推論用に最適化したモデルをロード
+     * 
+     * モデルをデバイスに移動してから、torch::jit::freezeでパラメータを定数として畳み込み、
+     * torch::jit::optimize_for_inferenceで推論用のグラフ最適化を行います（freeze_onlyがtrueならfreezeのみ）。
+     * 最適化したモデルはcache_dirに保存し、モデルファイルの内容・デバイス・型・libtorchのバージョン・最適化の方法が
+     * 同じであれば、次回以降は保存したものをロードして最適化を省略します。
+     * 
+     * @return 最適化したモデル
+     * @param[in] model_path モデルのパス
+     * @param[in] device 推論に用いるデバイス
+     * @param[in] cache_dir 最適化したモデルを保存するディレクトリ
+     * @param[in] freeze_only optimize_for_inferenceを行わず、freezeのみにするか
+     * @note 最適化したモデルを保存できない場合は、警告を出してキャッシュせずに続行します。
+     * optimize_for_inferenceは推論専用の変換（MKLDNNの形式への変換など）を含むため、forwardの中で微分するモデルでは
+     * 推論できなくなる場合があります。その場合はfreeze_only = trueを使ってください。
+     */
+    torch::jit::script::Module load_optimized_model(const std::string& model_path, const torch::Device& device, const std::string& cache_dir, const bool freeze_only = false);
+    /**
+     * @brief モデルの線形層を動的なint8量子化で置き換え
+     * 
+     * モデルをfreezeしてパラメータを定数にしたうえで、重みが定数のaten::linearを
+     * quantized::linear_dynamicに置き換えます。重みは出力チャネルごとの対称なスケールでint8に量子化し、
+     * 入力は推論のたびに動的に量子化されます。
+     * 
+     * @return 量子化したモデル
+     * @param[in] module 元のモデル（CPU上にあり、評価モードであること）
+     * @param[out] num_quantized 置き換えた線形層の数
+     * @note 量子化したカーネルはCPUでのみ動作します。aten::linear以外（matmulなど）で書かれた層は置き換えません。
+     * quantized::linear_dynamicは微分できないため、forwardの中でtorch.autograd.gradを呼ぶモデル（calls_autograd()がtrue）には
+     * 使えません。その場合は例外を投げます。
+     */
+    torch::jit::script::Module quantize_dynamic_int8(const torch::jit::script::Module& module, IntType& num_quantized);
+    /**
+     * @brief 2つのモデルのポテンシャルと力を比較し、精度と推論時間を出力
+     * @param[in] reference 基準のモデル（float）
+     * @param[in] model 比較するモデル（量子化したものなど）
+     * @param[in] atoms 系
+     * @param[in] NL 構築済みの隣接リスト
+     * @param[in] workspace グラフ構築の作業領域
+     */
+    void print_accuracy_report(Model& reference, Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace);
+    /**
+     * @brief 1回の推論にかかる時間を計測
+     * @return 1回の推論にかかる時間の平均 (ms)
+     * @param[in] model モデル
+     * @param[in] atoms 系
+     * @param[in] NL 構築済みの隣接リスト
+     * @param[in] workspace グラフ構築の作業領域
+     * @param[in] repeats 計測する回数
+     * @param[in] warmup 計測前に捨てる回数
+     * @note グラフの構築は計測に含めません。
+     */
+    double benchmark_forward(Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace, const IntType repeats = 10, const IntType warmup = 3);
      /**
      * @brief 系の原子番号・接続情報から系のポテンシャル・力を推論
      * @return ポテンシャル・力
@@ -33,8 +111,12 @@ namespace inference{
      * (num_edges, num_edges)のtorch::Tensor
      * @param[in] edge_weight 接続している原子同士の、原子間距離
      * (num_edges, )のtorch::Tensor
+     * @param[in] inference_mode c10::InferenceModeのもとで推論するか
+     * @param[in] batch 各原子が属する系の番号 (N, )（未定義、またはforwardがbatchを受け取らないモデルなら渡さない）
+     * @note 既定では勾配を有効にして推論します（forwardの中でtorch.autograd.gradを呼ぶモデルがあるため）。
+     * calls_autograd()がfalseのモデルに限り、inference_mode = trueとして勾配のための情報を作らずに推論できます。
      */
-    c10::ivalue::TupleElements infer_from_tensor(torch::jit::script::Module& module, torch::Tensor x, torch::Tensor edge_index, torch::Tensor edge_weight);                                                         
+    c10::ivalue::TupleElements infer_from_tensor(torch::jit::script::Module& module, torch::Tensor x, torch::Tensor edge_index, torch::Tensor edge_weight, const bool inference_mode = false, const torch::Tensor& batch = torch::Tensor());                                                         
      /**
      * @brief 系の前処理
      * 
@@ -49,8 +131,10 @@ namespace inference{
      * (num_edges, )のtorch::Tensor
      * @param[in] atoms 前処理する系
      * @param[in] cutoff カットオフ距離
+     * @param[in] block_size 距離を計算するブロックの行数（0以下ならブロックに分けない）
+     * @note (block_size, N)ずつ距離を計算するため、メモリ使用量はO(block_size * N)です。
      */
-    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> RadiusInteractionGraph(Atoms& atoms, torch::Tensor cutoff);                                       //cutoff距離以内にある原子のペアを探す
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> RadiusInteractionGraph(Atoms& atoms, torch::Tensor cutoff, const IntType block_size = 2048);                                       //cutoff距離以内にある原子のペアを探す
      /**
      * @brief 系の前処理
      * @return 原子番号・接続情報
@@ -62,6 +146,7 @@ namespace inference{
      * (num_edges, )のtorch::Tensor
      * @param[in] atoms 前処理する系
      * @param[in] NL 隣接リスト
+     * @note ハーフリストの場合も、両方向のエッジに展開して返します。
      */
     std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> RadiusInteractionGraph(Atoms& atoms, NeighbourList NL);                                           //隣接リストを使用する場合はこっち
      /**
@@ -70,23 +155,77 @@ namespace inference{
      * @param[in] module モデル
      * @param[in] atoms 系
      * @param[in] cutoff カットオフ距離
+     * @param[in] block_size 距離を計算するブロックの行数（0以下ならブロックに分けない）
      */
-    void calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, torch::Tensor cutoff);                                                   //一つの構造に対して、エネルギーと力を計算
+    void calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, torch::Tensor cutoff, const IntType block_size = 2048);                                                   //一つの構造に対して、エネルギーと力を計算
      /**
      * @brief 系に対して、ポテンシャルと力を推論し、力とポテンシャルを系にセット
      * @param[in] module モデル
      * @param[in] atoms 系
      * @param[in] NL 隣接リスト
+     * @note マージンの自動調整が有効な場合は、グラフ構築にかかった時間をNLに記録します。
+     */
+    void calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, NeighbourList& NL);
+     /**
+     * @brief 系に対して、ポテンシャルと力を推論し、力とポテンシャルを系にセット
+     * 
+     * グラフの構築に作業領域のバッファを再利用します。MDのように毎ステップ呼ぶ場合はこちらを用います。
+     * モデルのバックエンド（TorchScript・AOTInductor）によらず使えます。
+     * 
+     * @param[in] model モデル
+     * @param[in] atoms 系
+     * @param[in] NL 隣接リスト
+     * @param[in] workspace グラフ構築の作業領域
+     * @note マージンの自動調整が有効な場合は、グラフ構築にかかった時間をNLに記録します。
      */
-    void calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, NeighbourList NL);
+    void calc_energy_and_force_MLP(Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace);
+     /**
+     * @brief 独立な複数の系をまとめて推論し、力とポテンシャルをそれぞれの系にセット
+     * 
+     * 各系のグラフを、エッジのインデックスを原子数の累積和だけずらして1つの非連結なグラフに結合し、
+     * 1回のforwardで推論します。力は原子数ごとに分割して各系にセットします。
+     * 各原子が属する系の番号をbatchとしてモデルに渡し、系ごとのポテンシャル (K, )を返させます。
+     * ポテンシャルは、モデルが系ごと (K, ) または原子ごと (N_total, ) の値を返す場合のみ各系にセットします。
+     * 
+     * @return ポテンシャルを各系にセットできたか（モデルが全体で1つの値を返す場合はfalse）
+     * @param[in] model モデル
+     * @param[in] atoms 系のリスト
+     * @param[in] NLs 系ごとの隣接リスト
+     * @param[in] workspaces 系ごとのグラフ構築の作業領域
+     */
+    bool calc_energy_and_force_MLP_batched(Model& model, std::vector<Atoms>& atoms, std::vector<NeighbourList>& NLs, std::vector<GraphWorkspace>& workspaces);
+     /**
+     * @brief コミッティ（複数のモデル）の力のばらつきを計算
+     * 
+     * 直前に作業領域で作成したグラフをそのまま使い、グラフを作り直さずにコミッティの各モデルを推論します。
+     * 基準の力（通常はシミュレーションに使っているモデルの力）とコミッティの力の、原子ごとの標準偏差
+     * σ_i = sqrt(<|F_i - <F_i>|^2>) を求め、その最大値を返します。
+     * 
+     * @return 原子ごとの力の標準偏差の最大値 (eV/Å)、0次元のtorch::Tensor
+     * @param[in] committee 基準のモデル以外のコミッティのモデル
+     * @param[in] reference_forces 基準のモデルの力 (N, 3)
+     * @param[in] workspace 基準の力を求めたときのグラフ構築の作業領域
+     * @note 基準の力を求めてから原子の位置を更新する前に呼んでください。
+     */
+    torch::Tensor committee_force_deviation(std::vector<Model>& committee, const torch::Tensor& reference_forces, const GraphWorkspace& workspace);
      /**
      * @brief 系に対して、ポテンシャルを推論し、力をその微分から計算します。その後、力とポテンシャルを系にセット
-     * @note 使う必要はありません。
+     * 
+     * エッジの距離ベクトルに対するエネルギーの勾配 g_ij = ∂E/∂r_ij を1回の逆伝播で求め、
+     * ソース原子に+g_ij、ターゲット原子に-g_ijを1回のindex_add_でまとめて加算します。
+     * 計算グラフは逆伝播の後に解放されます（retain_graphを使いません）。
+     * calc_virialがtrueの場合は、同じ勾配からビリアル W = -Σ r_ij ⊗ g_ij も求めて系にセットします（追加の推論は不要です）。
+     * 
+     * @note 力を直接返さず、エネルギーのみを使うモデルに用います。InferenceModeは使いません。
+     * モデルの出力はポテンシャルのtorch::Tensor、またはポテンシャルを先頭の要素とするタプルである必要があります。
+     * ポテンシャルが原子ごとの値の場合は、その和を系のポテンシャルとします。
      * @param[in] module モデル
      * @param[in] atoms 系
      * @param[in] NL 隣接リスト
+     * @param[in] workspace グラフ構築の作業領域
+     * @param[in] calc_virial ビリアルを計算するか
      */
-    void infer_energy_with_MLP_and_clac_force(torch::jit::script::Module& module, Atoms& atoms, NeighbourList NL);
+    void infer_energy_with_MLP_and_clac_force(torch::jit::script::Module& module, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace, const bool calc_virial = false);
 }
 
 #endif
\ No newline at end of file
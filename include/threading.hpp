@@ -0,0 +1,47 @@
+/**
+* @file threading.hpp
+* @brief CPUのスレッド数・コアの割り当て・NUMAノードのメモリ配置の設定
+*/
+
+#ifndef THREADING_HPP
+#define THREADING_HPP
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+namespace threading{
+    /**
+     * @brief CPUの番号のリストを解釈
+     * @return CPUの番号（重複なし、昇順）
+     * @param[in] spec "0-15,32-47"のような、番号または範囲のカンマ区切りの指定
+     */
+    std::vector<int> parse_cpu_list(const std::string& spec);
+    /**
+     * @brief CPUの番号が属するNUMAノードを取得
+     * @return NUMAノードの番号（取得できない場合は-1）
+     * @param[in] cpu CPUの番号
+     */
+    int numa_node_of_cpu(const int cpu);
+    /**
+     * @brief libtorchのスレッド数・コアの割り当て・メモリ配置を設定し、その結果を出力
+     *
+     * 1. プロセスを指定したコアに固定し、以降に作られるスレッドもそのコアの中で動くようにします。
+     * 2. numa_bindがtrueの場合は、メモリの確保先をそのコアが属するNUMAノードに限定します。
+     * 3. intra-op・inter-opのスレッド数を設定し、intra-opのワーカースレッドを1つずつコアに固定します。
+     *
+     * ワーカースレッドは固定したコアで最初に書き込むため、大きなtorch::Tensorの記憶領域は
+     * first-touchによりそのコアのNUMAノードに置かれます。
+     *
+     * @param[in] num_threads intra-opのスレッド数（0以下ならコアの数、コアの指定もなければlibtorchの既定値）
+     * @param[in] num_interop_threads inter-opのスレッド数（0以下ならlibtorchの既定値）
+     * @param[in] cpu_list 使用するコアの指定（空文字列なら固定しない）
+     * @param[in] numa_bind メモリの確保先をコアのNUMAノードに限定するか
+     * @note 他の処理でlibtorchのスレッドが作られる前に、プログラムの最初に1度だけ呼んでください。
+     * コアの固定とメモリ配置はLinuxでのみ有効です。
+     */
+    void configure(const IntType num_threads, const IntType num_interop_threads, const std::string& cpu_list, const bool numa_bind);
+}
+
+#endif
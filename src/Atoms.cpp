@@ -57,6 +57,7 @@ Atoms::Atoms(std::vector<Atom> atoms, torch::Device device) : device_(device)
     types_ = types;
 
     potential_energy_ = torch::tensor(0.0, torch::TensorOptions().device(device).dtype(kRealType));
+    virial_ = torch::zeros({3, 3}, torch::TensorOptions().device(device).dtype(kRealType));
 }
 
 Atoms::Atoms(int N, torch::Device device) : n_atoms_(torch::tensor(N, kIntType)), device_(device)
@@ -74,6 +75,7 @@ Atoms::Atoms(int N, torch::Device device) : n_atoms_(torch::tensor(N, kIntType))
     boltzmann_constant_ = torch::tensor(boltzmann_constant, torch::TensorOptions().dtype(kRealType).device(device_));
 
     potential_energy_ = torch::tensor(0.0, torch::TensorOptions().device(device).dtype(kRealType));
+    virial_ = torch::zeros({3, 3}, torch::TensorOptions().device(device).dtype(kRealType));
 }
 
 Atoms::Atoms(torch::Device device) : Atoms(0, device)
@@ -88,7 +90,8 @@ void Atoms::set_positions(const torch::Tensor& positions) {
 }
 void Atoms::set_velocities(const torch::Tensor& velocities) { 
     TORCH_CHECK(velocities.size(0) == n_atoms_.item<int64_t>() && velocities.size(1) == 3, "velocitiesの形状は(N, 3)である必要があります。");
-    velocities_ = velocities; 
+    //固定原子の速度は0
+    velocities_ = mobile_.defined() ? velocities * mobile_ : velocities; 
 }
 void Atoms::set_forces(const torch::Tensor& forces) { 
     TORCH_CHECK(forces.size(0) == n_atoms_.item<int64_t>() && forces.size(1) == 3, "forcesの形状は(N, 3)である必要があります。");
@@ -106,10 +109,27 @@ void Atoms::set_potential_energy(const torch::Tensor& potential_energy){
     TORCH_CHECK(potential_energy.dim() == 0, "potential_energyの次元は0である必要があります。");
     potential_energy_ = potential_energy;
 }
+void Atoms::set_virial(const torch::Tensor& virial){
+    TORCH_CHECK(virial.dim() == 2 && virial.size(0) == 3 && virial.size(1) == 3, "virialの形状は(3, 3)である必要があります。");
+    virial_ = virial;
+}
 void Atoms::set_atomic_numbers(const torch::Tensor& atomic_numbers){
     TORCH_CHECK(atomic_numbers.size(0) == n_atoms_.item<int64_t>(), "原子番号の形状は(N, )である必要があります。");
     atomic_numbers_ = atomic_numbers;
 }
+void Atoms::set_frozen(const torch::Tensor& frozen){
+    TORCH_CHECK(frozen.dim() == 1 && frozen.size(0) == n_atoms_.item<int64_t>(), "frozenの形状は(N, )である必要があります。");
+    const IntType num_frozen = frozen.sum().item<IntType>();
+    if(num_frozen == 0){
+        frozen_ = torch::Tensor();
+        mobile_ = torch::Tensor();
+        return;
+    }
+    frozen_ = frozen.to(device_, torch::kBool);
+    mobile_ = frozen_.logical_not().to(kRealType).unsqueeze(1);
+    n_mobile_ = torch::tensor(n_atoms_.item<IntType>() - num_frozen, kIntType);
+    velocities_ = velocities_ * mobile_;
+}
 void Atoms::set_types(const std::vector<std::string>& types){
     torch::TensorOptions options = torch::TensorOptions().device(device_);
     types_ = types;
@@ -129,6 +149,11 @@ void Atoms::to(torch::Device device) {
     atomic_numbers_ = atomic_numbers_.to(device);
     n_atoms_ = n_atoms_.to(device);
     potential_energy_ = potential_energy_.to(device);
+    virial_ = virial_.to(device);
+    if(frozen_.defined()){
+        frozen_ = frozen_.to(device);
+        mobile_ = mobile_.to(device);
+    }
     box_size_ = box_size_.to(device);
 }
 
@@ -141,10 +166,14 @@ torch::Tensor Atoms::kinetic_energy() const {
 }
 
 torch::Tensor Atoms::temperature() const {
-    auto dof = 3 * n_atoms_;
+    auto dof = 3 * num_mobile();
     auto tempareture = 2 * kinetic_energy() / (dof * boltzmann_constant_);
     return tempareture;
 }
+torch::Tensor Atoms::pressure() const {
+    auto volume = box_size_.pow(3);
+    return (2 * kinetic_energy() + virial_.trace()) / (3 * volume);
+}
 
 //周期境界条件の補正
 void Atoms::apply_pbc(){
@@ -168,14 +197,48 @@ void Atoms::positions_update(const torch::Tensor dt, torch::Tensor& box){
 void Atoms::velocities_update(const torch::Tensor dt){
     //masses_.unsqueeze(1): (N, ) -> (N, 1)
     //単位変換 (eV / Å・u) -> ((Å / (fs^2))
-    velocities_ += 0.5 * dt * (forces_ / masses_.unsqueeze(1)) * conversion_factor_;
+    if(mobile_.defined()){
+        //固定原子は力を受けても動かない
+        velocities_ += 0.5 * dt * (forces_ / masses_.unsqueeze(1)) * conversion_factor_ * mobile_;
+    }
+    else{
+        velocities_ += 0.5 * dt * (forces_ / masses_.unsqueeze(1)) * conversion_factor_;
+    }
 }
 
 void Atoms::remove_drift() {
+    if(mobile_.defined()){
+        //可動原子のみの平均速度を除去する
+        torch::Tensor drift_velocity = torch::sum(velocities_, 0) / n_mobile_.to(device_);
+        velocities_ = (velocities_ - drift_velocity) * mobile_;
+        return;
+    }
     torch::Tensor drift_velocity = torch::mean(velocities_, 0);
     velocities_ -= drift_velocity;
 }
 
+//原子の選択
+torch::Tensor Atoms::select_by_species(const std::vector<std::string>& species) const {
+    const IntType N = n_atoms_.item<IntType>();
+    torch::Tensor selected = torch::zeros({N}, torch::TensorOptions().dtype(torch::kBool));
+    auto accessor = selected.accessor<bool, 1>();
+    for(IntType i = 0; i < N; i++){
+        accessor[i] = std::find(species.begin(), species.end(), types_[i]) != species.end();
+    }
+    return selected.to(device_);
+}
+
+torch::Tensor Atoms::select_by_index(const IntType first, const IntType last) const {
+    torch::Tensor index = torch::arange(n_atoms_.item<IntType>(), torch::TensorOptions().device(device_).dtype(kIntType));
+    return (index >= first) & (index <= last);
+}
+
+torch::Tensor Atoms::select_by_region(const IntType axis, const RealType lower, const RealType upper) const {
+    TORCH_CHECK(0 <= axis && axis < 3, "軸は0, 1, 2のいずれかである必要があります。");
+    torch::Tensor coordinate = positions_.select(1, axis);
+    return (coordinate >= lower) & (coordinate < upper);
+}
+
 Atoms Atoms::make_LJ_unit(const IntType N, const RealType ratio, const RealType rho, const torch::Device& device) {
     Atoms atoms = Atoms(N, device);
     torch::TensorOptions options = torch::TensorOptions().device(device).dtype(kRealType);
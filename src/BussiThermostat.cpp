@@ -14,7 +14,7 @@ BussiThermostat::BussiThermostat(const RealType& targ_temp, const RealType& tau,
 
 //セットアップ
 void BussiThermostat::setup(const Atoms& atoms) {
-    setup(3 * atoms.size());
+    setup(3 * atoms.num_mobile());
 }
 
 void BussiThermostat::setup(const torch::Tensor& dof) {
@@ -0,0 +1,8 @@
+#include "ForceProvider.hpp"
+#include "LJ.hpp"
+#include "config.h"
+
+//LJポテンシャルによる力の計算
+void LJForceProvider::calc_energy_and_force(Atoms& atoms, NeighbourList& NL){
+    LJ::calc_energy_and_force(atoms, NL);
+}
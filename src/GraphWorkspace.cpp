@@ -0,0 +1,255 @@
+#include "GraphWorkspace.hpp"
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+GraphWorkspace::GraphWorkspace(const RealType growth) : growth_(growth)
+{
+    //値が不正でないかのチェック
+    if(growth_ < 1.0){
+        throw std::invalid_argument("容量を広げる倍率は1以上である必要があります。");
+    }
+}
+
+//パディングの設定
+void GraphWorkspace::set_padding(const bool padding){
+    if(padding != padding_){
+        //出力用バッファの大きさが変わるため、作り直す
+        clear();
+    }
+    padding_ = padding;
+}
+
+//部分グラフの設定
+void GraphWorkspace::set_subgraph(const torch::Tensor& mobile, const IntType hops){
+    torch::Tensor next = mobile.defined() ? mobile.to(torch::kBool) : torch::Tensor();
+    //前回と同じ設定なら、インデックスをまとめ直さない（差分推論では毎ステップ呼ばれるため）
+    const bool same = hops == subgraph_hops_ && next.defined() == mobile_.defined()
+                      && (!next.defined() || (next.sizes() == mobile_.sizes() && next.device() == mobile_.device() && torch::equal(next, mobile_)));
+    mobile_ = next;
+    subgraph_hops_ = hops;
+    if(!same){
+        //次のbuild()で残す原子を求め直す
+        build_id_ = 0;
+    }
+}
+
+//部分グラフの値を系全体に戻す
+torch::Tensor GraphWorkspace::scatter_to_atoms(const torch::Tensor& values) const{
+    if(!active_index_.defined()){
+        return values;
+    }
+    std::vector<int64_t> shape = values.sizes().vec();
+    shape[0] = num_atoms_;
+    return torch::zeros(shape, values.options()).index_copy_(0, active_index_, values);
+}
+
+//隣接リストのエッジをたどって原子の集合を広げる
+torch::Tensor GraphWorkspace::expand_hops(const torch::Tensor& atoms, const NeighbourList& NL, const IntType hops){
+    const torch::Tensor& source_index = NL.source_index();
+    const torch::Tensor& target_index = NL.target_index();
+    torch::Tensor reached = atoms.to(source_index.device(), torch::kBool).clone();
+    for(IntType hop = 0; hop < hops; hop++){
+        torch::Tensor next = reached.clone();
+        //ハーフリストでも届くように、両方向にたどる
+        next.index_put_({target_index.index({reached.index({source_index})})}, true);
+        next.index_put_({source_index.index({reached.index({target_index})})}, true);
+        reached = next;
+    }
+    return reached;
+}
+
+//バケットの大きさへの切り上げ
+IntType GraphWorkspace::bucket(const IntType num_edges){
+    constexpr IntType min_step = 256;
+    //エッジ数の1/16以下で最大の2のべきを刻みにする
+    IntType step = min_step;
+    while(step * 32 <= num_edges){
+        step *= 2;
+    }
+    return std::max<IntType>((num_edges + step - 1) / step * step, min_step);
+}
+
+//作業領域の解放
+void GraphWorkspace::clear(){
+    build_id_ = 0;
+    capacity_ = 0;
+    output_capacity_ = 0;
+    directions_ = 1;
+    num_edges_ = 0;
+    edge_index_ = torch::Tensor();
+    cutoff2_ = torch::Tensor();
+    output_index_ = torch::Tensor();
+    active_index_ = torch::Tensor();
+    active_numbers_ = torch::Tensor();
+    num_atoms_ = 0;
+    source_pos_ = torch::Tensor();
+    diff_pos_vec_ = torch::Tensor();
+    shift_ = torch::Tensor();
+    dist2_ = torch::Tensor();
+    mask_ = torch::Tensor();
+    selected_ = torch::Tensor();
+    edge_index_buffer_ = torch::Tensor();
+    distance_vectors_buffer_ = torch::Tensor();
+    last_graph_ = {};
+}
+
+//バッファの容量の確保
+void GraphWorkspace::reserve(const IntType num_edges, const IntType directions, const torch::TensorOptions& options){
+    //容量・方向数・デバイスが足りていれば何もしない
+    if(source_pos_.defined() && num_edges <= capacity_ && directions <= directions_ && source_pos_.device() == options.device()){
+        return;
+    }
+
+    //再構築のたびにエッジ数が少し増えても確保し直さないように、余裕をもって確保する
+    const IntType capacity = std::max<IntType>(static_cast<IntType>(std::ceil(num_edges * growth_)), 1);
+    const torch::TensorOptions index_options = options.dtype(kIntType);
+
+    source_pos_ = torch::empty({capacity, 3}, options);
+    diff_pos_vec_ = torch::empty({capacity, 3}, options);
+    shift_ = torch::empty({capacity, 3}, options);
+    dist2_ = torch::empty({capacity}, options);
+    mask_ = torch::empty({capacity}, options.dtype(torch::kBool));
+    selected_ = torch::empty({capacity, 1}, index_options);
+    //パディングする場合は、出力の最大のエッジ数を切り上げたバケットまで確保する
+    const IntType output_capacity = padding_ ? bucket(capacity * directions) : capacity * directions;
+    edge_index_buffer_ = torch::empty({2 * output_capacity}, index_options);
+    distance_vectors_buffer_ = torch::empty({output_capacity, 3}, options);
+
+    capacity_ = capacity;
+    output_capacity_ = output_capacity;
+    directions_ = directions;
+}
+
+//隣接リストごとのキャッシュ
+void GraphWorkspace::prepare(const Atoms& atoms, const NeighbourList& NL){
+    half_ = NL.is_half();
+
+    torch::Tensor source_index = NL.source_index();
+    torch::Tensor target_index = NL.target_index();
+    num_atoms_ = atoms.size().item<IntType>();
+
+    if(subgraph()){
+        //可動原子から隣接リストのエッジをたどって、hopsホップ以内の原子を求める
+        //隣接リストはマージンの分だけ広いため、位置が更新されても実際のグラフのホップ数以内の原子を含む
+        torch::Tensor active = expand_hops(mobile_, NL, subgraph_hops_);
+
+        //両端が残る原子のエッジのみを使う
+        torch::Tensor keep = active.index({source_index}) & active.index({target_index});
+        source_index = source_index.index({keep});
+        target_index = target_index.index({keep});
+
+        //原子の番号を部分グラフの中で詰め直す
+        active_index_ = active.nonzero().squeeze(1);
+        torch::Tensor local_index = torch::full({num_atoms_}, -1, source_index.options());
+        local_index.index_put_({active_index_}, torch::arange(active_index_.size(0), source_index.options()));
+        output_index_ = torch::stack({local_index.index({source_index}), local_index.index({target_index})});
+        active_numbers_ = atoms.atomic_numbers().index_select(0, active_index_);
+    }
+    else{
+        active_index_ = torch::Tensor();
+        active_numbers_ = torch::Tensor();
+    }
+
+    //インデックスを一つのtorch::Tensorにまとめておく
+    edge_index_ = torch::stack({source_index, target_index});
+    num_edges_ = edge_index_.size(1);
+    if(!subgraph()){
+        output_index_ = edge_index_;
+    }
+
+    //実際のカットオフ距離の2乗
+    //モデルは学習したカットオフ距離以内のすべてのエッジを使うため、それより短い原子種ペアごとのカットオフ距離は使えない
+    if(NL.has_pair_cutoffs() && (NL.pair_cutoffs() < NL.cutoff()).any().item<bool>()){
+        throw std::invalid_argument("モデルで推論する場合、原子種ペアごとのカットオフ距離をcutoffより短くすることはできません（モデルのエッジが欠けるため）。");
+    }
+    cutoff2_ = NL.cutoff().pow(2);
+    //ダミーのエッジは、カットオフ距離よりも遠くに置く
+    pad_distance_ = 2 * NL.cutoff().max().item<RealType>();
+
+    reserve(num_edges_, half_ ? 2 : 1, atoms.positions().options());
+    build_id_ = NL.build_id();
+}
+
+//隣接リストからグラフを作成
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> GraphWorkspace::build(const Atoms& atoms, const NeighbourList& NL){
+    //隣接リストが変わったときだけ、インデックスをまとめ直す
+    if(NL.build_id() != build_id_){
+        prepare(atoms, NL);
+    }
+
+    const torch::Tensor& pos = atoms.positions();
+    const torch::Tensor& Lbox = atoms.box_size();
+    const IntType E = num_edges_;
+
+    //バッファのうち、使う部分のビュー
+    torch::Tensor source_pos = source_pos_.narrow(0, 0, E);
+    torch::Tensor diff_pos_vec = diff_pos_vec_.narrow(0, 0, E);
+    torch::Tensor shift = shift_.narrow(0, 0, E);
+    torch::Tensor dist2 = dist2_.narrow(0, 0, E);
+    torch::Tensor mask = mask_.narrow(0, 0, E);
+
+    //読み込んだインデックスの原子から、距離を計算
+    torch::index_select_out(source_pos, pos, 0, edge_index_[0]);
+    torch::index_select_out(diff_pos_vec, pos, 0, edge_index_[1]);
+    torch::sub_out(diff_pos_vec, source_pos, diff_pos_vec);
+
+    //周期境界条件の適用
+    torch::div_out(shift, diff_pos_vec, Lbox);
+    shift.add_(0.5).floor_().mul_(Lbox);
+    diff_pos_vec.sub_(shift);
+
+    //実際のカットオフ距離でフィルタリング
+    torch::mul_out(shift, diff_pos_vec, diff_pos_vec);
+    torch::sum_out(dist2, shift, {1});
+    torch::lt_out(mask, dist2, cutoff2_);
+
+    //カットオフ距離以内のエッジの番号
+    //形状の変わる出力のリサイズで警告が出ないよう、一度空にしてから書き込む（記憶領域は保持される）
+    selected_.resize_({0, 1});
+    torch::nonzero_out(selected_, mask);
+    const IntType E_filtered = selected_.size(0);
+    const torch::Tensor selected = selected_.select(1, 0);
+
+    //ハーフリストの場合は、フィルタリング後のペアを両方向に展開する
+    const IntType E_real = half_ ? 2 * E_filtered : E_filtered;
+    //パディングする場合は、バケットの大きさに切り上げる
+    const IntType E_out = padding_ ? bucket(E_real) : E_real;
+    torch::Tensor edge_index = edge_index_buffer_.narrow(0, 0, 2 * E_out).view({2, E_out});
+    torch::Tensor distance_vectors = distance_vectors_buffer_.narrow(0, 0, E_out);
+
+    torch::Tensor source_index = edge_index[0];
+    torch::Tensor target_index = edge_index[1];
+    //位置の参照には系全体の番号、出力には（部分グラフなら詰め直した）番号を使う
+    torch::index_select_out(source_index.narrow(0, 0, E_filtered), output_index_[0], 0, selected);
+    torch::index_select_out(target_index.narrow(0, 0, E_filtered), output_index_[1], 0, selected);
+    torch::Tensor forward_vectors = distance_vectors.narrow(0, 0, E_filtered);
+    torch::index_select_out(forward_vectors, diff_pos_vec, 0, selected);
+    forward_vectors.neg_();
+
+    if(half_){
+        //(j, i)の距離ベクトルは(i, j)の符号を反転したもの
+        torch::index_select_out(source_index.narrow(0, E_filtered, E_filtered), output_index_[1], 0, selected);
+        torch::index_select_out(target_index.narrow(0, E_filtered, E_filtered), output_index_[0], 0, selected);
+        torch::neg_out(distance_vectors.narrow(0, E_filtered, E_filtered), forward_vectors);
+    }
+
+    //余りをダミーのエッジ（原子0の自己ループ、長さはカットオフ距離の2倍）で埋める
+    if(E_out > E_real){
+        const IntType E_pad = E_out - E_real;
+        source_index.narrow(0, E_real, E_pad).fill_(0);
+        target_index.narrow(0, E_real, E_pad).fill_(0);
+        torch::Tensor pad_vectors = distance_vectors.narrow(0, E_real, E_pad);
+        pad_vectors.fill_(0);
+        pad_vectors.select(1, 0).fill_(pad_distance_);
+    }
+
+    //各原子の原子番号を取得（部分グラフなら、残した原子のもの）
+    torch::Tensor x = active_index_.defined() ? active_numbers_ : atoms.atomic_numbers();
+
+    last_graph_ = std::make_tuple(x, edge_index, distance_vectors);
+    return last_graph_;
+}
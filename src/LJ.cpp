@@ -1,4 +1,22 @@
 #include "LJ.hpp"
+#include "graph_ops.hpp"
+
+#include <tuple>
+
+namespace {
+    // ペアごとのカットオフ距離
+    // 基本は同種なら1.5, 異種なら2.0で、隣接リストに原子種ペアごとのカットオフ距離があれば明示的に指定したペアのみ置き換える
+    torch::Tensor pair_cutoffs(const NeighbourList& NL, const torch::Tensor& source_atomic_numbers, const torch::Tensor& target_atomic_numbers, const torch::Device& device) {
+        torch::Tensor same_type_mask = (source_atomic_numbers == target_atomic_numbers);
+        torch::Tensor cutoffs = torch::where(same_type_mask, 1.5, 2.0).to(device);
+        if (NL.has_pair_cutoffs()) {
+            torch::Tensor values = NL.pair_cutoffs().index({source_atomic_numbers, target_atomic_numbers}).to(device);
+            torch::Tensor listed = NL.pair_cutoffs_listed().index({source_atomic_numbers, target_atomic_numbers}).to(device);
+            cutoffs = torch::where(listed, values.to(cutoffs.scalar_type()), cutoffs);
+        }
+        return cutoffs;
+    }
+}
 
 torch::Tensor LJ::LJpotential(const torch::Tensor distances, const torch::Tensor sigmas) {
     const torch::Tensor dist6 = torch::pow(distances, 6);
@@ -16,42 +34,28 @@ void LJ::calc_force(Atoms& atoms, NeighbourList NL) {
     const auto device = atoms.device();
 
     const torch::Tensor& pos = atoms.positions();
-    const torch::Tensor& Lbox = atoms.box_size();
-    const torch::Tensor Linv = 1 / Lbox;
-
-    //NLから読み込んだインデックスの原子の距離を計算
-    const torch::Tensor source_pos = pos.index({NL.source_index()});
-    const torch::Tensor target_pos = pos.index({NL.target_index()});
-
-    torch::Tensor diff_pos_vec = source_pos - target_pos;
-    diff_pos_vec -= Lbox * torch::floor(diff_pos_vec * Linv + 0.5);
-
-    // 距離の2乗を計算
-    torch::Tensor dist2 = torch::sum(diff_pos_vec.pow(2), 1);
 
     // 種類の判定のために、フィルタリング前の全ペアの原子番号を取得
     torch::Tensor atomic_numbers = atoms.atomic_numbers();
     torch::Tensor source_atomic_numbers_all = atomic_numbers.index({NL.source_index()});
     torch::Tensor target_atomic_numbers_all = atomic_numbers.index({NL.target_index()});
 
-    // ペアごとのカットオフ距離を計算 (同種なら1.5, 異種なら2.0)
-    torch::Tensor same_type_mask = (source_atomic_numbers_all == target_atomic_numbers_all);
-    torch::Tensor cutoffs = torch::where(same_type_mask, 1.5, 2.0).to(device);
-    torch::Tensor cutoff2s = cutoffs.pow(2);
+    // ペアごとのカットオフ距離の2乗
+    torch::Tensor cutoff2s = pair_cutoffs(NL, source_atomic_numbers_all, target_atomic_numbers_all, device).pow(2);
 
-    // ペアごとのカットオフ距離でフィルタリング
-    torch::Tensor mask = torch::lt(dist2, cutoff2s); // dist2 < cutoff^2
+    // 距離ベクトルの計算・最小イメージ規約・ペアごとのカットオフ距離でのフィルタリングを1回で行う
+    torch::Tensor edge_index, distance_vectors;
+    std::tie(edge_index, distance_vectors) = graph_ops::radius_filter(pos, atoms.box_size(), NL.source_index(), NL.target_index(), cutoff2s, false);
 
-    // マスクを適用
-    torch::Tensor source_index = NL.source_index().index({mask});
-    torch::Tensor target_index = NL.target_index().index({mask});
-    dist2 = dist2.index({mask});
-    diff_pos_vec = diff_pos_vec.index({mask});
-    cutoffs = cutoffs.index({mask}); // 使用するカットオフ値もフィルタリング
+    torch::Tensor source_index = edge_index[0];
+    torch::Tensor target_index = edge_index[1];
+    torch::Tensor diff_pos_vec = -distance_vectors;    // ソース - ターゲット
+    torch::Tensor dist2 = torch::sum(diff_pos_vec.pow(2), 1);
 
-    // フィルタリング後のペアの原子番号
-    torch::Tensor source_atomic_numbers = source_atomic_numbers_all.index({mask});
-    torch::Tensor target_atomic_numbers = target_atomic_numbers_all.index({mask});
+    // フィルタリング後のペアの原子番号と、使用するカットオフ値
+    torch::Tensor source_atomic_numbers = atomic_numbers.index({source_index});
+    torch::Tensor target_atomic_numbers = atomic_numbers.index({target_index});
+    torch::Tensor cutoffs = pair_cutoffs(NL, source_atomic_numbers, target_atomic_numbers, device);
 
     //力の計算
     torch::Tensor dist = torch::sqrt(dist2);
@@ -65,54 +69,49 @@ void LJ::calc_force(Atoms& atoms, NeighbourList NL) {
     torch::Tensor force_vec = force_scalar.unsqueeze(1) * diff_pos_vec;
 
     //加算
-    torch::Tensor total_forces = torch::zeros_like(pos);
-
-    total_forces.index_add_(0, source_index, force_vec);
-    total_forces.index_add_(0, target_index, -force_vec);
+    torch::Tensor total_forces;
+    if(NL.is_half()){
+        //作用・反作用の法則より、iとjの両方に加算する
+        total_forces = torch::zeros_like(pos);
+        total_forces.index_add_(0, source_index, force_vec);
+        total_forces.index_add_(0, target_index, -force_vec);
+    }
+    else{
+        //フルリストでは(i, j)と(j, i)の両方を含むため、ソース原子側の和だけで力が求まる
+        //エッジはソース原子の順に並んでいるので、散らばった書き込みの代わりに区間ごとの和をとる
+        torch::Tensor row_offsets = NeighbourList::make_row_offsets(source_index, pos.size(0));
+        total_forces = torch::segment_reduce(force_vec, "sum", c10::nullopt, c10::nullopt, row_offsets, 0, /*unsafe=*/true, /*initial=*/0.0);
+    }
 
     //力をセット
-    atoms.set_forces(total_forces / 2.0);
+    atoms.set_forces(total_forces);
 }
 
 void LJ::calc_potential(Atoms& atoms, NeighbourList NL) {
     const auto device = atoms.device();
     const torch::Tensor& pos = atoms.positions();
-    const torch::Tensor& Lbox = atoms.box_size();
-    const torch::Tensor Linv = 1 / Lbox;
-
-    //NLから読み込んだインデックスの原子の距離を計算
-    const torch::Tensor source_pos = pos.index({NL.source_index()});
-    const torch::Tensor target_pos = pos.index({NL.target_index()});
-
-    torch::Tensor diff_pos_vec = source_pos - target_pos;
-    diff_pos_vec -= Lbox * torch::floor(diff_pos_vec * Linv + 0.5);
-
-    // 距離の2乗を計算
-    torch::Tensor dist2 = torch::sum(diff_pos_vec.pow(2), 1);
 
     // 種類の判定のために、フィルタリング前の全ペアの原子番号を取得
     torch::Tensor atomic_numbers = atoms.atomic_numbers();
     torch::Tensor source_atomic_numbers_all = atomic_numbers.index({NL.source_index()});
     torch::Tensor target_atomic_numbers_all = atomic_numbers.index({NL.target_index()});
 
-    // ペアごとのカットオフ距離を計算 (同種なら1.5, 異種なら2.0)
-    torch::Tensor same_type_mask = (source_atomic_numbers_all == target_atomic_numbers_all);
-    torch::Tensor cutoffs = torch::where(same_type_mask, 1.5, 2.0).to(device);
-    torch::Tensor cutoff2s = cutoffs.pow(2);
+    // ペアごとのカットオフ距離の2乗
+    torch::Tensor cutoff2s = pair_cutoffs(NL, source_atomic_numbers_all, target_atomic_numbers_all, device).pow(2);
 
-    // ペアごとのカットオフ距離でフィルタリング
-    torch::Tensor mask = torch::lt(dist2, cutoff2s); // dist2 < cutoff^2
+    // 距離ベクトルの計算・最小イメージ規約・ペアごとのカットオフ距離でのフィルタリングを1回で行う
+    torch::Tensor edge_index, distance_vectors;
+    std::tie(edge_index, distance_vectors) = graph_ops::radius_filter(pos, atoms.box_size(), NL.source_index(), NL.target_index(), cutoff2s, false);
 
-    // マスクを適用
-    torch::Tensor source_index = NL.source_index().index({mask});
-    torch::Tensor target_index = NL.target_index().index({mask});
-    dist2 = dist2.index({mask});
-    diff_pos_vec = diff_pos_vec.index({mask});
-    cutoffs = cutoffs.index({mask}); // 使用するカットオフ値もフィルタリング
+    torch::Tensor source_index = edge_index[0];
+    torch::Tensor target_index = edge_index[1];
+    torch::Tensor diff_pos_vec = -distance_vectors;    // ソース - ターゲット
+    torch::Tensor dist2 = torch::sum(diff_pos_vec.pow(2), 1);
 
-    // フィルタリング後のペアの原子番号
-    torch::Tensor source_atomic_numbers = source_atomic_numbers_all.index({mask});
-    torch::Tensor target_atomic_numbers = target_atomic_numbers_all.index({mask});
+    // フィルタリング後のペアの原子番号と、使用するカットオフ値
+    torch::Tensor source_atomic_numbers = atomic_numbers.index({source_index});
+    torch::Tensor target_atomic_numbers = atomic_numbers.index({target_index});
+    torch::Tensor cutoffs = pair_cutoffs(NL, source_atomic_numbers, target_atomic_numbers, device);
 
     //ポテンシャルの計算
     torch::Tensor dist = torch::sqrt(dist2);
@@ -125,7 +124,8 @@ void LJ::calc_potential(Atoms& atoms, NeighbourList NL) {
     torch::Tensor potential = torch::sum(potentials);
 
     //ポテンシャルをセット
-    atoms.set_potential_energy(potential / 2.0);
+    //フルリストの場合は各ペアを2回数えているので2で割る
+    atoms.set_potential_energy(NL.is_half() ? potential : potential / 2.0);
 }
 
 void LJ::calc_energy_and_force(Atoms& atoms, NeighbourList NL) {
@@ -0,0 +1,71 @@
+#include "Model.hpp"
+#include "inference.hpp"
+#include "config.h"
+
+#include <iostream>
+#include <stdexcept>
+
+Model::Model(const std::string& path, const torch::Device& device, const std::string& backend)
+     : path_(path), backend_(backend)
+{
+    if(backend_ == "torchscript"){
+        module_ = inference::load_model(path_);
+        module_.to(device);
+        supports_inference_mode_ = !inference::calls_autograd(module_);
+    }
+    else if(backend_ == "aoti"){
+#ifdef MD_MLP_WITH_AOTI
+        try{
+            //パッケージはコンパイル時のデバイス向けのカーネルを含むため、デバイスの番号のみを指定する
+            aoti_ = std::make_shared<torch::inductor::AOTIModelPackageLoader>(path_, "model", false, 1, device.has_index() ? device.index() : -1);
+            std::cout << "コンパイル済みのモデルをロードしました：" << path_ << std::endl;
+        }
+        catch(const c10::Error& e){
+            std::cerr << "コンパイル済みのモデルの読み込みに失敗しました。" << std::endl
+                      << e.what() << std::endl;
+            throw;
+        }
+#else
+        throw std::invalid_argument("バックエンド\"aoti\"を使うには、MD_MLP_WITH_AOTIを有効にしてビルドしてください。");
+#endif
+    }
+    else{
+        throw std::invalid_argument("モデルのバックエンドは\"torchscript\", \"aoti\"のいずれかである必要があります。");
+    }
+}
+
+//推論
+std::pair<torch::Tensor, torch::Tensor> Model::forward(const torch::Tensor& x, const torch::Tensor& edge_index, const torch::Tensor& edge_weight, const bool inference_mode, const torch::Tensor& batch){
+#ifdef MD_MLP_WITH_AOTI
+    if(backend_ == "aoti"){
+        c10::InferenceMode guard(inference_mode);
+        std::vector<torch::Tensor> outputs = aoti_->run({x, edge_index, edge_weight});
+        TORCH_CHECK(outputs.size() >= 2, "コンパイル済みのモデルは(ポテンシャル, 力)を返す必要があります。");
+        return std::make_pair(outputs[0], outputs[1]);
+    }
+#endif
+    if(inference_mode && supports_inference_mode_){
+        auto result = inference::infer_from_tensor(module_, x, edge_index, edge_weight, true, batch);
+        return std::make_pair(result[0].toTensor(), result[1].toTensor());
+    }
+
+    //forwardの中で微分するモデルは、勾配を有効にして推論する
+    //モデルの中で作られた計算グラフを速度・位置の更新に持ち込まないよう、切り離して返す
+    auto result = inference::infer_from_tensor(module_, x, edge_index, edge_weight, false, batch);
+    return std::make_pair(result[0].toTensor().detach(), result[1].toTensor().detach());
+}
+
+torch::jit::script::Module& Model::module(){
+    if(backend_ != "torchscript"){
+        throw std::logic_error("TorchScriptのモデルではありません（バックエンド: " + backend_ + "）。");
+    }
+    return module_;
+}
+
+void Model::set_module(torch::jit::script::Module module){
+    if(backend_ != "torchscript"){
+        throw std::logic_error("TorchScriptのモデルではありません（バックエンド: " + backend_ + "）。");
+    }
+    module_ = std::move(module);
+    supports_inference_mode_ = !inference::calls_autograd(module_);
+}
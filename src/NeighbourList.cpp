@@ -1,7 +1,23 @@
 #include "NeighbourList.hpp"
 #include "config.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
+
+#include <ATen/Parallel.h>
+
+namespace {
+    //構築ごとの識別番号の発行（バックグラウンドの構築とも重複しないようにatomicにする）
+    std::atomic<IntType> build_id_counter{0};
+}
 
 NeighbourList::NeighbourList(torch::Tensor cutoff, torch::Tensor margin, torch::Device device)
               : cutoff_(cutoff), margin_(margin), device_(device) 
@@ -23,46 +39,475 @@ void NeighbourList::to(torch::Device device){
     device_ = device;
     source_index_ = source_index_.to(device);
     target_index_ = target_index_.to(device);
+    row_offsets_ = row_offsets_.to(device);
+    for(auto& view_end : view_ends_){
+        view_end = view_end.to(device);
+    }
     NL_config_ = NL_config_.to(device);
     cutoff_ = cutoff_.to(device);
     margin_ = margin_.to(device);
+    //原子種ペアごとのカットオフ距離と構築時の原子番号は、設定されている場合のみ移動する
+    if(pair_cutoffs_.defined()){
+        pair_cutoffs_ = pair_cutoffs_.to(device);
+        pair_cutoffs_listed_ = pair_cutoffs_listed_.to(device);
+    }
+    if(atomic_numbers_.defined()){
+        atomic_numbers_ = atomic_numbers_.to(device);
+    }
+    build_id_ = ++build_id_counter;
+}
+
+//構築方法の設定
+void NeighbourList::set_method(const std::string& method){
+    if(method != "auto" && method != "dense" && method != "cell" && method != "native"){
+        throw std::invalid_argument("隣接リストの構築方法は\"auto\", \"dense\", \"cell\", \"native\"のいずれかである必要があります。");
+    }
+    method_ = method;
+}
+
+void NeighbourList::set_cell_threshold(const IntType cell_threshold){
+    if(cell_threshold < 0){
+        throw std::invalid_argument("cell_thresholdは0以上である必要があります。");
+    }
+    cell_threshold_ = cell_threshold;
+}
+
+//原子種ペアごとのカットオフ距離の設定
+void NeighbourList::set_pair_cutoffs(const torch::Tensor& pair_cutoffs){
+    if(pair_cutoffs.dim() != 2 || pair_cutoffs.size(0) != pair_cutoffs.size(1)){
+        throw std::invalid_argument("ペアごとのカットオフ距離は正方行列である必要があります。");
+    }
+    if((pair_cutoffs > cutoff_.to(pair_cutoffs.device())).any().item<bool>()){
+        throw std::invalid_argument("ペアごとのカットオフ距離はcutoff以下である必要があります。");
+    }
+    //NaNの要素は指定していないペアとして記録し、cutoffで埋める
+    const torch::Tensor values = pair_cutoffs.to(device_, kRealType);
+    pair_cutoffs_listed_ = values.isnan().logical_not();
+    pair_cutoffs_ = torch::where(pair_cutoffs_listed_, values, cutoff_.to(kRealType));
+}
+
+torch::Tensor NeighbourList::parse_pair_cutoffs(const std::string& spec){
+    //行列の大きさは最大の原子番号 + 1
+    int max_number = 0;
+    for(const auto& pair : atom_number_map){
+        max_number = std::max(max_number, pair.second);
+    }
+    //指定していないペアはNaNにしておく
+    torch::Tensor pair_cutoffs = torch::full({max_number + 1, max_number + 1}, std::nan(""), torch::TensorOptions().dtype(kRealType));
+
+    std::istringstream spec_stream(spec);
+    std::string entry;
+    //"Si-O:2.3"をカンマ区切りで読み込む
+    while(std::getline(spec_stream, entry, ',')){
+        const std::size_t hyphen_pos = entry.find('-');
+        const std::size_t colon_pos = entry.find(':');
+        if(hyphen_pos == std::string::npos || colon_pos == std::string::npos || colon_pos < hyphen_pos){
+            throw std::invalid_argument("ペアごとのカットオフ距離の形式が不正です：" + entry);
+        }
+        const std::string type_i = entry.substr(0, hyphen_pos);
+        const std::string type_j = entry.substr(hyphen_pos + 1, colon_pos - hyphen_pos - 1);
+        if(!atom_number_map.count(type_i) || !atom_number_map.count(type_j)){
+            throw std::invalid_argument("未知の元素記号です：" + entry);
+        }
+        const int Z_i = atom_number_map.at(type_i);
+        const int Z_j = atom_number_map.at(type_j);
+        const RealType value = std::stod(entry.substr(colon_pos + 1));
+        pair_cutoffs[Z_i][Z_j].fill_(value);
+        pair_cutoffs[Z_j][Z_i].fill_(value);
+    }
+
+    return pair_cutoffs;
+}
+
+//マージンの自動調整の設定
+void NeighbourList::set_auto_margin(const bool auto_margin, const RealType margin_min, const RealType margin_max){
+    if(margin_min <= 0 || margin_max < margin_min){
+        throw std::invalid_argument("マージンの範囲は0 < margin_min <= margin_maxである必要があります。");
+    }
+    auto_margin_ = auto_margin;
+    margin_min_ = margin_min;
+    margin_max_ = margin_max;
+}
+
+//グラフ構築時間の記録（移動平均）
+void NeighbourList::record_graph_time(const double seconds){
+    graph_time_ = graph_time_ > 0.0 ? 0.8 * graph_time_ + 0.2 * seconds : seconds;
 }
 
 //NLの作成
 void NeighbourList::generate(const Atoms& atoms){
-    torch::TensorOptions options = torch::TensorOptions().device(device_);
+    auto start = std::chrono::steady_clock::now();
+
+    //バックグラウンドで構築中の隣接リストは古くなるため破棄する（構築の終了を待つ）
+    pending_.reset();
+
     torch::Tensor pos = atoms.positions().to(device_);  //位置ベクトル (N, 3)
     torch::Tensor Lbox = atoms.box_size().to(device_);  //シミュレーションボックスの大きさ
+    atomic_numbers_ = atoms.atomic_numbers().to(device_);
+
+    //1辺あたりのセル数（セルの1辺がcutoff + margin以上になるようにとる）
+    const IntType n_cells = static_cast<IntType>(std::floor(Lbox.item<RealType>() / (list_cutoff() + margin_).item<RealType>()));
+    //隣接する27セルが重複しないためには、1辺あたり3セル以上必要
+    const bool use_cell = n_cells >= 3 && (method_ == "cell" || (method_ == "auto" && pos.size(0) > cell_threshold_));
+
+    if(method_ == "native"){
+        generate_native(pos, Lbox);
+    }
+    else if(use_cell){
+        generate_cell(pos, Lbox, n_cells);
+    }
+    else{
+        generate_dense(pos, Lbox);
+    }
+
+    build_csr(pos, Lbox);
+    NL_config_ = pos.clone();
+    steps_since_rebuild_ = 0;
+    build_id_ = ++build_id_counter;
+
+    //構築時間の記録（移動平均）
+    //where・itemで同期しているため、CUDAでもおおよその時間が得られる
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    generate_time_ = generate_time_ > 0.0 ? 0.8 * generate_time_ + 0.2 * elapsed : elapsed;
+}
+
+//全ペアからNLを作成
+void NeighbourList::generate_dense(const torch::Tensor& pos, const torch::Tensor& Lbox){
     torch::Tensor Linv = 1.0 / Lbox;                    //ボックスの大きさの逆数
-    //系全体でのijペアの数を数える変数
-    torch::Tensor nlist = torch::tensor(-1, options.dtype(kIntType));
-    //距離の計算
-    //pos.unsqueeze(1) -> (N, 1, 3)
-    //pos.unsqueeze(0) -> (1, N, 3)
-    torch::Tensor diff_position = pos.unsqueeze(1) - pos.unsqueeze(0); //(N, N, 3)
-    //周期境界条件の適用
-    diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
-    //距離の2乗を計算
-    //diff_positionの要素を2乗し、dim=2について足す
-    torch::Tensor dist2 = torch::sum(diff_position.pow(2), 2); //(N, N)
+    const IntType N = pos.size(0);
+    //ブロックの行数（0以下ならブロックに分けない）
+    const IntType block = block_size_ > 0 ? block_size_ : std::max<IntType>(N, 1);
     //マージンを考慮したカットオフ距離
-    torch::Tensor rlist2 = (cutoff_ + margin_).pow(2);
-    //dist2 < rlist2を満たすなら1(true), 満たさないなら0(false)
-    torch::Tensor mask = dist2 < rlist2;
-    //i = jを除外
-    mask.fill_diagonal_(0);
-    //インデックスの取得
-    //indices[0]がiのインデックス、indices[1]がjのインデックス
-    auto indices = torch::where(mask);
-    source_index_ = indices[0].to(kIntType);
-    target_index_ = indices[1].to(kIntType);
-    //各粒子iが持つ隣接粒子の数を計算
-    torch::Tensor num_neighbours = mask.sum({1}).to(kIntType);
-    NL_config_ = pos.clone();
+    torch::Tensor rlist2 = (list_cutoff() + margin_).pow(2);
+    //原子種ペアごとのカットオフ距離がある場合は、原子番号の組から引く行列
+    torch::Tensor pair_rlist2 = has_pair_cutoffs() ? (pair_cutoffs_ + margin_).pow(2) : torch::Tensor();
+
+    std::vector<torch::Tensor> sources;
+    std::vector<torch::Tensor> targets;
+
+    //(block, N)ずつ処理することで、メモリ使用量をO(block * N)に抑える
+    for(IntType begin = 0; begin < N; begin += block){
+        const IntType end = std::min(begin + block, N);
+        torch::Tensor rows = pos.slice(0, begin, end);  //(B, 3)
+        //距離の計算
+        //rows.unsqueeze(1) -> (B, 1, 3)
+        //pos.unsqueeze(0) -> (1, N, 3)
+        torch::Tensor diff_position = rows.unsqueeze(1) - pos.unsqueeze(0); //(B, N, 3)
+        //周期境界条件の適用
+        diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
+        //距離の2乗を計算
+        //diff_positionの要素を2乗し、dim=2について足す
+        torch::Tensor dist2 = torch::sum(diff_position.pow(2), 2); //(B, N)
+        //dist2 < rlist2を満たすなら1(true), 満たさないなら0(false)
+        torch::Tensor mask;
+        if(pair_rlist2.defined()){
+            torch::Tensor row_numbers = atomic_numbers_.slice(0, begin, end);
+            mask = dist2 < pair_rlist2.index({row_numbers.unsqueeze(1), atomic_numbers_.unsqueeze(0)}); //(B, N)
+        }
+        else{
+            mask = dist2 < rlist2;
+        }
+        if(half_){
+            //ハーフリストの場合はi < jのみを残す（i = jも除外される）
+            mask.triu_(begin + 1);
+        }
+        else{
+            //i = jを除外（ブロック内ではbegin列だけずれた対角成分）
+            mask.diagonal(begin).fill_(0);
+        }
+        //インデックスの取得
+        //indices[0]がブロック内のiのインデックス、indices[1]がjのインデックス
+        auto indices = torch::where(mask);
+        sources.push_back(indices[0].to(kIntType) + begin);
+        targets.push_back(indices[1].to(kIntType));
+    }
+
+    if(sources.empty()){
+        source_index_ = torch::zeros({0}, torch::TensorOptions().device(device_).dtype(kIntType));
+        target_index_ = torch::zeros({0}, torch::TensorOptions().device(device_).dtype(kIntType));
+        return;
+    }
+
+    source_index_ = torch::cat(sources);
+    target_index_ = torch::cat(targets);
 }
 
-void NeighbourList::update(const Atoms& atoms){
+//CPU上のC++実装でNLを作成
+void NeighbourList::generate_native(const torch::Tensor& pos, const torch::Tensor& Lbox){
+    //生の配列として扱うため、CPU上の連続したfloat配列にする
+    torch::Tensor pos_cpu = pos.to(torch::kCPU, torch::kFloat32).contiguous();
+    const float* p = pos_cpu.data_ptr<float>();
+    const int64_t N = pos_cpu.size(0);
+    const float L = Lbox.item<float>();
+    const float Linv = 1.0f / L;
+    const float rlist = (list_cutoff() + margin_).item<float>();
+    const float rlist2 = rlist * rlist;
+    const bool half = half_;
+
+    //原子種ペアごとのカットオフ距離がある場合は、原子番号の組から引く表
+    const bool use_pair = has_pair_cutoffs();
+    torch::Tensor pair_rlist2_cpu;
+    torch::Tensor numbers_cpu;
+    const float* pair_rlist2 = nullptr;
+    const int64_t* numbers = nullptr;
+    int64_t n_species = 0;
+    if(use_pair){
+        pair_rlist2_cpu = (pair_cutoffs_ + margin_).pow(2).to(torch::kCPU, torch::kFloat32).contiguous();
+        numbers_cpu = atomic_numbers_.to(torch::kCPU, torch::kInt64).contiguous();
+        pair_rlist2 = pair_rlist2_cpu.data_ptr<float>();
+        numbers = numbers_cpu.data_ptr<int64_t>();
+        n_species = pair_rlist2_cpu.size(0);
+    }
+
+    //1辺あたりのセル数（3未満の場合は全ペアを探索）
+    const int64_t n_cells = static_cast<int64_t>(std::floor(L / rlist));
+    const bool use_cell = n_cells >= 3;
+
+    //セルごとの原子のリスト（counting sortで作成するため、各セル内は原子番号の昇順）
+    std::vector<int64_t> cell_of(N, 0);
+    std::vector<int64_t> cell_start;
+    std::vector<int64_t> cell_atoms;
+    if(use_cell){
+        const int64_t n_cells_total = n_cells * n_cells * n_cells;
+        cell_start.assign(n_cells_total + 1, 0);
+        cell_atoms.resize(N);
+        for(int64_t i = 0; i < N; i ++){
+            int64_t c[3];
+            for(int d = 0; d < 3; d ++){
+                const float x = p[3 * i + d];
+                const float wrapped = x - L * std::floor(x * Linv + 0.5f);
+                c[d] = std::clamp<int64_t>(static_cast<int64_t>(std::floor((wrapped * Linv + 0.5f) * n_cells)), 0, n_cells - 1);
+            }
+            cell_of[i] = (c[0] * n_cells + c[1]) * n_cells + c[2];
+            cell_start[cell_of[i] + 1] ++;
+        }
+        for(int64_t c = 0; c < n_cells_total; c ++){
+            cell_start[c + 1] += cell_start[c];
+        }
+        std::vector<int64_t> fill(cell_start.begin(), cell_start.end() - 1);
+        for(int64_t i = 0; i < N; i ++){
+            cell_atoms[fill[cell_of[i]] ++] = i;
+        }
+    }
+
+    //原子iの隣接原子候補jそれぞれについて、カットオフ内ならfuncを呼ぶ
+    auto for_each_neighbour = [&](const int64_t i, auto&& func){
+        const float xi = p[3 * i], yi = p[3 * i + 1], zi = p[3 * i + 2];
+        auto check = [&](const int64_t j){
+            if(j == i || (half && j < i)){
+                return;
+            }
+            //denseと同じ演算順で距離を計算
+            float dx = xi - p[3 * j];
+            float dy = yi - p[3 * j + 1];
+            float dz = zi - p[3 * j + 2];
+            dx -= L * std::floor(dx * Linv + 0.5f);
+            dy -= L * std::floor(dy * Linv + 0.5f);
+            dz -= L * std::floor(dz * Linv + 0.5f);
+            const float cutoff2 = use_pair ? pair_rlist2[numbers[i] * n_species + numbers[j]] : rlist2;
+            if(dx * dx + dy * dy + dz * dz < cutoff2){
+                func(j);
+            }
+        };
+
+        if(!use_cell){
+            for(int64_t j = 0; j < N; j ++){
+                check(j);
+            }
+            return;
+        }
+
+        const int64_t ci = cell_of[i];
+        const int64_t cx = ci / (n_cells * n_cells);
+        const int64_t cy = (ci / n_cells) % n_cells;
+        const int64_t cz = ci % n_cells;
+        for(int64_t dx = -1; dx <= 1; dx ++){
+            for(int64_t dy = -1; dy <= 1; dy ++){
+                for(int64_t dz = -1; dz <= 1; dz ++){
+                    const int64_t nx = (cx + dx + n_cells) % n_cells;
+                    const int64_t ny = (cy + dy + n_cells) % n_cells;
+                    const int64_t nz = (cz + dz + n_cells) % n_cells;
+                    const int64_t nc = (nx * n_cells + ny) * n_cells + nz;
+                    for(int64_t k = cell_start[nc]; k < cell_start[nc + 1]; k ++){
+                        check(cell_atoms[k]);
+                    }
+                }
+            }
+        }
+    };
+
+    //1回目の走査：各原子の隣接原子数を数える
+    std::vector<int64_t> offsets(N + 1, 0);
+    at::parallel_for(0, N, 64, [&](int64_t begin, int64_t end){
+        for(int64_t i = begin; i < end; i ++){
+            int64_t count = 0;
+            for_each_neighbour(i, [&](int64_t){ count ++; });
+            offsets[i + 1] = count;
+        }
+    });
+    for(int64_t i = 0; i < N; i ++){
+        offsets[i + 1] += offsets[i];
+    }
+
+    //2回目の走査：確保したtorch::Tensorに直接書き込む
+    torch::Tensor source = torch::empty({offsets[N]}, torch::TensorOptions().dtype(torch::kInt64));
+    torch::Tensor target = torch::empty({offsets[N]}, torch::TensorOptions().dtype(torch::kInt64));
+    int64_t* s = source.data_ptr<int64_t>();
+    int64_t* t = target.data_ptr<int64_t>();
+    at::parallel_for(0, N, 64, [&](int64_t begin, int64_t end){
+        for(int64_t i = begin; i < end; i ++){
+            int64_t k = offsets[i];
+            for_each_neighbour(i, [&](int64_t j){
+                s[k] = i;
+                t[k] = j;
+                k ++;
+            });
+            //denseと同じく、各原子の隣接原子をインデックスの昇順に並べる
+            std::sort(t + offsets[i], t + offsets[i + 1]);
+        }
+    });
+
+    source_index_ = source.to(device_).to(kIntType);
+    target_index_ = target.to(device_).to(kIntType);
+}
+
+//CSR形式の行オフセットの作成
+void NeighbourList::build_csr(const torch::Tensor& pos, const torch::Tensor& Lbox){
+    //dense・cellのどちらでも、エッジは(i, j)の辞書順に並んでいる
+    //ビューを使う場合は、各行が距離順に並んでいる必要がある
+    const bool sort_rows = sort_by_distance_ || !view_radii_.empty();
+    torch::Tensor dist2;
+    if(sort_rows){
+        torch::Tensor Linv = 1.0 / Lbox;
+        torch::Tensor diff_position = pos.index({source_index_}) - pos.index({target_index_});
+        diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
+        dist2 = torch::sum(diff_position.pow(2), 1);
+        //距離で安定ソートした後、ソース原子で安定ソートすることで、各行の中が距離順になる
+        torch::Tensor order = std::get<1>(torch::sort(dist2, /*stable=*/c10::optional<bool>(true), 0));
+        order = order.index({std::get<1>(torch::sort(source_index_.index({order}), /*stable=*/c10::optional<bool>(true), 0))});
+        source_index_ = source_index_.index({order});
+        target_index_ = target_index_.index({order});
+        dist2 = dist2.index({order});
+    }
+
+    row_offsets_ = make_row_offsets(source_index_, pos.size(0));
+
+    //各ビューについて、各行の中で半径 + margin以内にある部分の終端を求める
+    //行の中は距離順なので、条件を満たすエッジは行の先頭から連続している
+    view_ends_.clear();
+    for(const RealType radius : view_radii_){
+        torch::Tensor inside = dist2 < (radius + margin_).pow(2);
+        torch::Tensor cumulative = torch::cat({torch::zeros({1}, row_offsets_.options()), torch::cumsum(inside, 0).to(kIntType)});
+        torch::Tensor row_begin = row_offsets_.slice(0, 0, -1);
+        torch::Tensor row_end = row_offsets_.slice(0, 1);
+        view_ends_.push_back(row_begin + cumulative.index({row_end}) - cumulative.index({row_begin}));
+    }
+}
+
+//ビューの追加
+IntType NeighbourList::add_view(const RealType radius){
+    if(radius <= 0){
+        throw std::invalid_argument("ビューの半径は正の数である必要があります。");
+    }
+    view_radii_.push_back(radius);
+    return static_cast<IntType>(view_radii_.size()) - 1;
+}
+
+//ビューのエッジ
+std::pair<torch::Tensor, torch::Tensor> NeighbourList::view_edges(const IntType view) const{
+    //エッジkが、ソース原子の行の中でビューの終端より前にあるか
+    torch::Tensor edge_position = torch::arange(source_index_.size(0), source_index_.options());
+    torch::Tensor mask = edge_position < view_ends_.at(view).index({source_index_});
+    return std::make_pair(source_index_.index({mask}), target_index_.index({mask}));
+}
+
+//隣接リストを構築する半径
+torch::Tensor NeighbourList::list_cutoff() const{
+    if(view_radii_.empty()){
+        return cutoff_;
+    }
+    const RealType max_radius = *std::max_element(view_radii_.begin(), view_radii_.end());
+    return torch::clamp_min(cutoff_, max_radius);
+}
+
+torch::Tensor NeighbourList::make_row_offsets(const torch::Tensor& sorted_source, const IntType num_atoms){
+    //各原子iについて、ソース原子のインデックスがi以上となる最初の位置を二分探索で求める
+    torch::Tensor atom_index = torch::arange(num_atoms + 1, sorted_source.options());
+    return torch::searchsorted(sorted_source, atom_index);
+}
+
+//セルリストからNLを作成
+void NeighbourList::generate_cell(const torch::Tensor& pos, const torch::Tensor& Lbox, const IntType n_cells){
     torch::TensorOptions options = torch::TensorOptions().device(device_);
+    torch::Tensor Linv = 1.0 / Lbox;                    //ボックスの大きさの逆数
+    const IntType N = pos.size(0);
+    const IntType n_cells_total = n_cells * n_cells * n_cells;
+
+    //各原子が属するセルの座標 (N, 3)
+    //ボックス内に戻した座標を[0, 1)に規格化してから、セル数を掛ける
+    torch::Tensor wrapped = pos - Lbox * torch::floor(pos * Linv + 0.5);
+    torch::Tensor cell_coords = torch::floor((wrapped * Linv + 0.5) * n_cells).to(kIntType).clamp(0, n_cells - 1);
+    torch::Tensor cell_id = (cell_coords.select(1, 0) * n_cells + cell_coords.select(1, 1)) * n_cells + cell_coords.select(1, 2);  //(N, )
+
+    //セル番号の順に原子を並べ、各セルの先頭位置と原子数を求める
+    torch::Tensor order = torch::argsort(cell_id);                                      //(N, )
+    torch::Tensor counts = torch::bincount(cell_id, {}, n_cells_total);                 //(n_cells_total, )
+    torch::Tensor starts = torch::cumsum(counts, 0) - counts;                           //(n_cells_total, )
+    const IntType max_per_cell = counts.max().item<IntType>();
+
+    torch::Tensor slots = torch::arange(max_per_cell, options.dtype(kIntType));         //(M, )
+    torch::Tensor i_index = torch::arange(N, options.dtype(kIntType)).unsqueeze(1).expand({N, max_per_cell});  //(N, M)
+    torch::Tensor rlist2 = (list_cutoff() + margin_).pow(2);
+    //原子種ペアごとのカットオフ距離がある場合は、原子番号の組から引く行列
+    torch::Tensor pair_rlist2 = has_pair_cutoffs() ? (pair_cutoffs_ + margin_).pow(2) : torch::Tensor();
+
+    std::vector<torch::Tensor> keys;
+    keys.reserve(27);
+
+    //隣接する27セルについて探索
+    for(IntType dx = -1; dx <= 1; dx ++){
+        for(IntType dy = -1; dy <= 1; dy ++){
+            for(IntType dz = -1; dz <= 1; dz ++){
+                torch::Tensor offset = torch::tensor({dx, dy, dz}, options.dtype(kIntType));
+                torch::Tensor neighbour_coords = torch::remainder(cell_coords + offset, n_cells);
+                torch::Tensor neighbour_id = (neighbour_coords.select(1, 0) * n_cells + neighbour_coords.select(1, 1)) * n_cells + neighbour_coords.select(1, 2);
+
+                //隣接セルに含まれる原子の候補 (N, M)
+                torch::Tensor valid = slots.unsqueeze(0) < counts.index({neighbour_id}).unsqueeze(1);
+                torch::Tensor slot_index = (starts.index({neighbour_id}).unsqueeze(1) + slots.unsqueeze(0)).clamp_max(N - 1);
+                torch::Tensor j_index = order.index({slot_index});
+
+                torch::Tensor source = i_index.index({valid});
+                torch::Tensor target = j_index.index({valid});
+
+                //距離の計算
+                torch::Tensor diff_position = pos.index({source}) - pos.index({target});
+                //周期境界条件の適用
+                diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
+                torch::Tensor dist2 = torch::sum(diff_position.pow(2), 1);
+
+                //i = jを除外
+                torch::Tensor pair_cutoff2 = pair_rlist2.defined() ? pair_rlist2.index({atomic_numbers_.index({source}), atomic_numbers_.index({target})}) : rlist2;
+                torch::Tensor mask = (dist2 < pair_cutoff2) & (source != target);
+                //ハーフリストの場合はi < jのみを残す
+                if(half_){
+                    mask &= source < target;
+                }
+
+                //並び替え用のキー (i * N + j)
+                keys.push_back(source.index({mask}) * N + target.index({mask}));
+            }
+        }
+    }
+
+    //denseと同じ (i, j) の辞書順に並べ替える
+    torch::Tensor key = std::get<0>(torch::sort(torch::cat(keys)));
+    source_index_ = torch::div(key, N, "floor").to(kIntType);
+    target_index_ = torch::remainder(key, N).to(kIntType);
+}
+
+//変位の最大の2原子の変位の和
+torch::Tensor NeighbourList::max_displacement(const Atoms& atoms) const{
     torch::Tensor pos = atoms.positions().to(device_);  //位置ベクトル (N, 3)
     torch::Tensor Lbox = atoms.box_size().to(device_);  //シミュレーションボックスの大きさ
     torch::Tensor Linv = 1.0 / Lbox;                    //ボックスの大きさの逆
@@ -73,14 +518,166 @@ void NeighbourList::update(const Atoms& atoms){
     diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
     //距離の2乗
     torch::Tensor dist2 = torch::sum(diff_position.pow(2), 1);  //(N, )
-    //大きい順にソートし、1番目と2番目に大きい距離を取得
-    auto sorted_result = torch::sort(dist2, -1, true);
-    torch::Tensor sorted_dist2 = std::get<0>(sorted_result);
-    torch::Tensor max1st = sorted_dist2[0];
-    torch::Tensor max2nd = sorted_dist2[1];
+    //1番目と2番目に大きい距離を、ソートせずにmaxの縮約2回で取得
+    //1番目の要素を0で埋めてからmaxをとることで、同じ値が複数あっても正しく2番目が得られる
+    torch::Tensor max1st = dist2.max();
+    torch::Tensor max2nd = dist2.index_fill(0, dist2.argmax().unsqueeze(0), 0).max();
+    return torch::sqrt(max1st) + torch::sqrt(max2nd);
+}
+
+//NLの確認
+torch::Tensor NeighbourList::needs_rebuild(const Atoms& atoms) const{
     //移動距離の和がマージンを超えたらNLを作り直す。
-    //torch::Tensorのままで比較すると、torch::Tensor型が返ってくるため、item<float>()でfloatに変換してから比較するか、比較した後でitem<bool>()でbool型に変換する。
-    if( (max1st + max2nd + 2 * torch::sqrt(max1st * max2nd) > margin_ * margin_).item<bool>() ){
+    //結果はデバイス上の0次元のbool型torch::Tensorのまま返す
+    return max_displacement(atoms) > margin_;
+}
+
+void NeighbourList::update(const Atoms& atoms){
+    if(!speculative_){
+        //デバイスからホストへの同期はここでの1回のみ
+        update(atoms, needs_rebuild(atoms).item<bool>());
+        return;
+    }
+
+    //変位の和とマージンの比（デバイスからホストへの同期はここでの1回のみ）
+    const RealType ratio = (max_displacement(atoms) / margin_).item<RealType>();
+    steps_since_rebuild_ ++;
+    if(ratio > 1.0){
+        num_rebuilds_ ++;
+        total_rebuild_interval_ += steps_since_rebuild_;
+        //バックグラウンドで構築した隣接リストが使えなければ、その場で構築する
+        if(!swap_speculative(atoms)){
+            margin_ = margin_ - extra_margin_applied_;
+            extra_margin_applied_ = 0.0;
+            generate(atoms);
+        }
+    }
+    else if(ratio > speculative_trigger_ && !pending_){
+        //再構築が近づいたら、バックグラウンドで次の隣接リストの構築を始める
+        launch_speculative(atoms);
+    }
+}
+
+void NeighbourList::update(const Atoms& atoms, const bool rebuild){
+    steps_since_rebuild_ ++;
+    if(rebuild){
+        //再構築までのステップ数を記録
+        num_rebuilds_ ++;
+        total_rebuild_interval_ += steps_since_rebuild_;
+        if(auto_margin_){
+            tune_margin();
+        }
         generate(atoms);
     }
-}
\ No newline at end of file
+}
+
+//投機的な再構築の設定
+void NeighbourList::set_speculative(const bool speculative, const RealType extra_margin, const RealType trigger_fraction){
+    if(extra_margin < 0){
+        throw std::invalid_argument("追加のマージンは0以上である必要があります。");
+    }
+    if(trigger_fraction <= 0 || trigger_fraction >= 1){
+        throw std::invalid_argument("投機的な再構築を始める割合は0より大きく1より小さい必要があります。");
+    }
+    speculative_ = speculative;
+    speculative_extra_margin_ = extra_margin;
+    speculative_trigger_ = trigger_fraction;
+}
+
+//バックグラウンドでの構築の開始
+void NeighbourList::launch_speculative(const Atoms& atoms){
+    //現在の配置のスナップショット（位置はin-placeで更新されるため複製する）
+    Atoms snapshot = atoms;
+    snapshot.set_positions(atoms.positions().clone());
+
+    //スナップショットからの変位を見込んで、マージンを広げた隣接リストを構築する
+    NeighbourList next = *this;
+    next.pending_.reset();
+    next.margin_ = margin_ - extra_margin_applied_ + speculative_extra_margin_;
+    next.extra_margin_applied_ = speculative_extra_margin_;
+
+    pending_ = std::make_shared<std::future<NeighbourList>>(std::async(std::launch::async, [next, snapshot]() mutable {
+        next.generate(snapshot);
+        return next;
+    }));
+}
+
+//バックグラウンドで構築した隣接リストへの入れ替え
+bool NeighbourList::swap_speculative(const Atoms& atoms){
+    if(!pending_){
+        return false;
+    }
+    //構築が終わっていなければ待つ
+    NeighbourList next = pending_->get();
+    pending_.reset();
+
+    //スナップショットからの変位が、広げたマージンに収まっているかを確認
+    if(next.needs_rebuild(atoms).item<bool>()){
+        return false;
+    }
+
+    //統計は引き継ぐ
+    const IntType num_rebuilds = num_rebuilds_;
+    const IntType total_rebuild_interval = total_rebuild_interval_;
+    const IntType num_speculative_swaps = num_speculative_swaps_;
+    *this = std::move(next);
+    num_rebuilds_ = num_rebuilds;
+    total_rebuild_interval_ = total_rebuild_interval;
+    num_speculative_swaps_ = num_speculative_swaps + 1;
+    steps_since_rebuild_ = 0;
+
+    return true;
+}
+
+//再構築の統計のリセット
+void NeighbourList::reset_statistics(){
+    num_rebuilds_ = 0;
+    total_rebuild_interval_ = 0;
+    num_speculative_swaps_ = 0;
+}
+
+//マージンの自動調整
+void NeighbourList::tune_margin(){
+    const IntType interval = steps_since_rebuild_;
+    const IntType num_edges = source_index_.size(0);
+    //グラフ構築の時間を記録する経路がない場合は、調整できないことを1度だけ知らせる
+    if(graph_time_ <= 0.0 && generate_time_ > 0.0 && !graph_time_warned_){
+        std::cerr << "グラフ構築の時間が記録されていないため、マージンの自動調整を行いません。" << std::endl;
+        graph_time_warned_ = true;
+    }
+    //計測値が揃っていない場合は調整しない
+    if(interval <= 0 || num_edges == 0 || generate_time_ <= 0.0 || graph_time_ <= 0.0){
+        return;
+    }
+
+    const double rc = list_cutoff().item<RealType>();
+    const double m0 = margin_.item<RealType>();
+    const double edge_time = graph_time_ / static_cast<double>(num_edges);     //1エッジあたりの時間
+
+    //1ステップあたりのコストの見積もり
+    //再構築の間隔はマージンに比例、エッジ数は(cutoff + margin)^3に比例すると仮定
+    auto cost = [&](const double m){
+        const double rebuild_cost = generate_time_ * m0 / (static_cast<double>(interval) * m);
+        const double edge_cost = edge_time * static_cast<double>(num_edges) * std::pow((rc + m) / (rc + m0), 3);
+        return rebuild_cost + edge_cost;
+    };
+
+    //[margin_min, margin_max]を等間隔に探索
+    constexpr int n_samples = 64;
+    double best_margin = m0;
+    double best_cost = cost(m0);
+    for(int k = 0; k <= n_samples; k ++){
+        const double m = margin_min_ + (margin_max_ - margin_min_) * k / n_samples;
+        const double c = cost(m);
+        if(c < best_cost){
+            best_cost = c;
+            best_margin = m;
+        }
+    }
+
+    //急激な変化を避ける
+    best_margin = std::clamp(best_margin, 0.8 * m0, 1.25 * m0);
+    best_margin = std::clamp(best_margin, static_cast<double>(margin_min_), static_cast<double>(margin_max_));
+
+    margin_ = torch::full_like(margin_, best_margin);
+}
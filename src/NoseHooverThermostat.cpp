@@ -45,7 +45,7 @@ NoseHooverThermostat::NoseHooverThermostat() : NoseHooverThermostat(1.0, torch::
 
 void NoseHooverThermostat::setup(Atoms& atoms) {
     //質量の初期化
-    dof_ = torch::tensor(3 * atoms.size().item<IntType>() - 3, torch::TensorOptions().device(device_).dtype(kIntType));
+    dof_ = torch::tensor(3 * atoms.num_mobile().item<IntType>() - 3, torch::TensorOptions().device(device_).dtype(kIntType));
     torch::Tensor tau2 = torch::pow(tau_, 2);
     masses_.fill_(boltzmann_constant_ * target_tmp_ * tau2);
     masses_[0] *= dof_;
@@ -0,0 +1,176 @@
+#include "graph_ops.hpp"
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <torch/library.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+    //CPUのカーネル
+    template <typename scalar_t>
+    void radius_filter_cpu_kernel(const scalar_t* pos, const scalar_t L, const int64_t* source, const int64_t* target,
+                                  const scalar_t* cutoff2, const bool per_edge_cutoff, const int64_t E,
+                                  std::vector<uint8_t>& keep, std::vector<int64_t>& offsets, const int num_chunks){
+        const scalar_t Linv = 1 / L;
+
+        //最小イメージ規約を適用した距離ベクトル（ソース - ターゲット）と、カットオフ距離以内か
+        auto displacement = [&](const int64_t e, scalar_t* d){
+            const int64_t i = source[e];
+            const int64_t j = target[e];
+            for(int k = 0; k < 3; k++){
+                const scalar_t diff = pos[3 * i + k] - pos[3 * j + k];
+                d[k] = diff - L * std::floor(diff * Linv + scalar_t(0.5));
+            }
+            const scalar_t dist2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+            return dist2 < cutoff2[per_edge_cutoff ? e : 0];
+        };
+
+        //1. 区間ごとに、残すエッジを数える
+        offsets.assign(num_chunks + 1, 0);
+#ifdef _OPENMP
+        #pragma omp parallel for num_threads(num_chunks) schedule(static)
+#endif
+        for(int chunk = 0; chunk < num_chunks; chunk++){
+            const int64_t begin = E * chunk / num_chunks;
+            const int64_t end = E * (chunk + 1) / num_chunks;
+            int64_t count = 0;
+            scalar_t d[3];
+            for(int64_t e = begin; e < end; e++){
+                keep[e] = displacement(e, d);
+                count += keep[e];
+            }
+            offsets[chunk + 1] = count;
+        }
+
+        //2. 累積和から、各区間の書き込み位置を決める
+        for(int chunk = 0; chunk < num_chunks; chunk++){
+            offsets[chunk + 1] += offsets[chunk];
+        }
+    }
+
+    template <typename scalar_t>
+    void radius_filter_cpu_write(const scalar_t* pos, const scalar_t L, const int64_t* source, const int64_t* target,
+                                 const int64_t E, const std::vector<uint8_t>& keep, const std::vector<int64_t>& offsets, const int num_chunks,
+                                 const bool half, int64_t* out_source, int64_t* out_target, scalar_t* out_vectors){
+        const scalar_t Linv = 1 / L;
+        const int64_t K = offsets[num_chunks];
+
+        //3. 残すエッジを、書き込み位置から詰めて書き込む
+#ifdef _OPENMP
+        #pragma omp parallel for num_threads(num_chunks) schedule(static)
+#endif
+        for(int chunk = 0; chunk < num_chunks; chunk++){
+            const int64_t begin = E * chunk / num_chunks;
+            const int64_t end = E * (chunk + 1) / num_chunks;
+            int64_t out = offsets[chunk];
+            for(int64_t e = begin; e < end; e++){
+                if(!keep[e]){
+                    continue;
+                }
+                const int64_t i = source[e];
+                const int64_t j = target[e];
+                out_source[out] = i;
+                out_target[out] = j;
+                for(int k = 0; k < 3; k++){
+                    const scalar_t diff = pos[3 * i + k] - pos[3 * j + k];
+                    //距離ベクトルはターゲット - ソース
+                    out_vectors[3 * out + k] = -(diff - L * std::floor(diff * Linv + scalar_t(0.5)));
+                }
+                //ハーフリストの場合は、(j, i)を後半に書き込む
+                if(half){
+                    out_source[K + out] = j;
+                    out_target[K + out] = i;
+                    for(int k = 0; k < 3; k++){
+                        out_vectors[3 * (K + out) + k] = -out_vectors[3 * out + k];
+                    }
+                }
+                out++;
+            }
+        }
+    }
+
+    //CPU
+    std::tuple<torch::Tensor, torch::Tensor> radius_filter_cpu(const torch::Tensor& positions, const torch::Tensor& box_size, const torch::Tensor& source_index, const torch::Tensor& target_index, const torch::Tensor& cutoff2, const bool half){
+        TORCH_CHECK(positions.dim() == 2 && positions.size(1) == 3, "positionsの形状は(N, 3)である必要があります。");
+        TORCH_CHECK(source_index.numel() == target_index.numel(), "source_indexとtarget_indexの長さが異なります。");
+        const int64_t E = source_index.numel();
+        const bool per_edge_cutoff = cutoff2.numel() != 1;
+        TORCH_CHECK(!per_edge_cutoff || cutoff2.numel() == E, "cutoff2は1要素、またはエッジごとの値である必要があります。");
+
+        const torch::Tensor pos = positions.contiguous();
+        const torch::Tensor source = source_index.to(torch::kLong).contiguous();
+        const torch::Tensor target = target_index.to(torch::kLong).contiguous();
+        const torch::Tensor cut2 = cutoff2.to(positions.scalar_type()).contiguous();
+
+        //区間の数はスレッド数まで（エッジが少ない場合は並列化の利点がないため、1つの区間で処理する）
+        constexpr int64_t grain_size = 32768;
+        const int num_chunks = static_cast<int>(std::max<int64_t>(1, std::min<int64_t>(at::get_num_threads(), E / grain_size)));
+
+        std::vector<uint8_t> keep(E);
+        std::vector<int64_t> offsets;
+        torch::Tensor edge_index, distance_vectors;
+
+        AT_DISPATCH_FLOATING_TYPES(pos.scalar_type(), "radius_filter_cpu", [&] {
+            const scalar_t L = box_size.item<scalar_t>();
+            radius_filter_cpu_kernel<scalar_t>(pos.data_ptr<scalar_t>(), L, source.data_ptr<int64_t>(), target.data_ptr<int64_t>(),
+                                               cut2.data_ptr<scalar_t>(), per_edge_cutoff, E, keep, offsets, num_chunks);
+
+            const int64_t K = offsets[num_chunks];
+            const int64_t E_out = half ? 2 * K : K;
+            edge_index = torch::empty({2, E_out}, source.options());
+            distance_vectors = torch::empty({E_out, 3}, pos.options());
+            radius_filter_cpu_write<scalar_t>(pos.data_ptr<scalar_t>(), L, source.data_ptr<int64_t>(), target.data_ptr<int64_t>(),
+                                              E, keep, offsets, num_chunks, half,
+                                              edge_index.data_ptr<int64_t>(), edge_index.data_ptr<int64_t>() + E_out, distance_vectors.data_ptr<scalar_t>());
+        });
+
+        return std::make_tuple(edge_index, distance_vectors);
+    }
+
+    //CPU以外（libtorchの演算の組み合わせ）
+    std::tuple<torch::Tensor, torch::Tensor> radius_filter_reference(const torch::Tensor& positions, const torch::Tensor& box_size, const torch::Tensor& source_index, const torch::Tensor& target_index, const torch::Tensor& cutoff2, const bool half){
+        torch::Tensor diff_pos_vec = positions.index_select(0, source_index) - positions.index_select(0, target_index);
+        diff_pos_vec -= box_size * torch::floor(diff_pos_vec / box_size + 0.5);
+
+        torch::Tensor selected = torch::lt(torch::sum(diff_pos_vec.pow(2), 1), cutoff2).nonzero().squeeze(1);
+        torch::Tensor source = source_index.index_select(0, selected);
+        torch::Tensor target = target_index.index_select(0, selected);
+        torch::Tensor distance_vectors = diff_pos_vec.index_select(0, selected).neg();
+
+        if(half){
+            return std::make_tuple(torch::stack({torch::cat({source, target}), torch::cat({target, source})}), torch::cat({distance_vectors, distance_vectors.neg()}));
+        }
+        return std::make_tuple(torch::stack({source, target}), distance_vectors);
+    }
+}
+
+//演算子の登録
+TORCH_LIBRARY(md_mlp, m) {
+    m.def("radius_filter(Tensor positions, Tensor box_size, Tensor source_index, Tensor target_index, Tensor cutoff2, bool half) -> (Tensor, Tensor)");
+}
+
+TORCH_LIBRARY_IMPL(md_mlp, CPU, m) {
+    m.impl("radius_filter", &radius_filter_cpu);
+}
+
+TORCH_LIBRARY_IMPL(md_mlp, CUDA, m) {
+    m.impl("radius_filter", &radius_filter_reference);
+}
+
+//C++からの呼び出し（デバイスに応じてディスパッチする）
+std::tuple<torch::Tensor, torch::Tensor> graph_ops::radius_filter(const torch::Tensor& positions, const torch::Tensor& box_size, const torch::Tensor& source_index, const torch::Tensor& target_index, const torch::Tensor& cutoff2, const bool half){
+    static const auto op = c10::Dispatcher::singleton()
+        .findSchemaOrThrow("md_mlp::radius_filter", "")
+        .typed<std::tuple<torch::Tensor, torch::Tensor>(const torch::Tensor&, const torch::Tensor&, const torch::Tensor&, const torch::Tensor&, const torch::Tensor&, bool)>();
+    return op.call(positions, box_size, source_index, target_index, cutoff2, half);
+}
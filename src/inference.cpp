@@ -1,5 +1,6 @@
 #include "Atoms.hpp"
 #include "inference.hpp"
+#include "graph_ops.hpp"
 #include "config.h"
 
 #include <vector>
@@ -9,14 +10,47 @@
 #include <cctype>
 #include <algorithm>
 #include <iomanip>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 
 #include <torch/script.h>
 #include <torch/torch.h>
+#include <torch/version.h>
+#include <torch/csrc/jit/ir/constants.h>
+#include <torch/csrc/jit/ir/ir.h>
+#include <torch/csrc/jit/passes/dead_code_elimination.h>
+#include <torch/csrc/jit/passes/inliner.h>
+#include <ATen/core/dispatch/Dispatcher.h>
+
+namespace {
+    //ファイルの内容のハッシュ値（64bitのFNV-1a）
+    std::uint64_t file_hash(const std::string& path){
+        std::ifstream file(path, std::ios::binary);
+        if(!file){
+            throw std::runtime_error("ファイルを開けませんでした：" + path);
+        }
+        std::uint64_t hash = 14695981039346656037ULL;
+        char buffer[1 << 16];
+        while(file.read(buffer, sizeof(buffer)) || file.gcount() > 0){
+            for(std::streamsize i = 0; i < file.gcount(); i++){
+                hash ^= static_cast<unsigned char>(buffer[i]);
+                hash *= 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+}
 
 torch::jit::script::Module inference::load_model(std::string model_path){
     try{
         torch::jit::script::Module module = torch::jit::load(model_path);
         std::cout << "モデルをロードしました：" << model_path << std::endl; 
+        prepare_model(module);
         return module; 
     }
     catch(c10::Error& e){
@@ -26,12 +60,226 @@ torch::jit::script::Module inference::load_model(std::string model_path){
     }
 }
 
+//推論用のモデルの準備
+void inference::prepare_model(torch::jit::script::Module& module){
+    //推論の前に1度だけ評価モードにする（毎ステップ呼ぶ必要はない）
+    module.eval();
+}
+
+//forwardの中でtorch.autograd.gradを呼ぶか
+bool inference::calls_autograd(const torch::jit::script::Module& module){
+    //サブモジュールのforwardの中も調べるため、グラフを複製して呼び出しを展開する
+    std::shared_ptr<torch::jit::Graph> graph = module.get_method("forward").graph()->copy();
+    torch::jit::Inline(*graph);
+
+    const c10::Symbol grad = c10::Symbol::fromQualString("aten::grad");
+    std::function<bool(torch::jit::Block*)> find = [&](torch::jit::Block* block){
+        for(torch::jit::Node* node : block->nodes()){
+            if(node->kind() == grad){
+                return true;
+            }
+            for(torch::jit::Block* sub_block : node->blocks()){
+                if(find(sub_block)){
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+    return find(graph->block());
+}
+
+//推論用に最適化したモデルのロード
+torch::jit::script::Module inference::load_optimized_model(const std::string& model_path, const torch::Device& device, const std::string& cache_dir, const bool freeze_only){
+    //キャッシュのキー（モデルの内容・デバイス・型・libtorchのバージョン・最適化の方法）
+    std::stringstream key;
+    key << std::hex << file_hash(model_path) << std::dec << "|" << device.str() << "|" << kRealType << "|" << TORCH_VERSION << "|" << (freeze_only ? "freeze" : "optimize");
+    std::stringstream name;
+    name << std::filesystem::path(model_path).stem().string() << "_" << std::hex << std::hash<std::string>{}(key.str()) << ".pt";
+    const std::filesystem::path cache_path = std::filesystem::path(cache_dir) / name.str();
+
+    //キャッシュがあればロードして終わり
+    if(std::filesystem::exists(cache_path)){
+        try{
+            torch::jit::script::Module module = torch::jit::load(cache_path.string(), device);
+            std::cout << "最適化済みのモデルをロードしました：" << cache_path.string() << std::endl;
+            return module;
+        }
+        catch(const c10::Error& e){
+            std::cerr << "最適化済みのモデルの読み込みに失敗したため、最適化し直します。" << std::endl
+                      << e.what() << std::endl;
+        }
+    }
+
+    //デバイスに移動してから最適化することで、パラメータをそのデバイス上の定数として畳み込む
+    torch::jit::script::Module module = load_model(model_path);
+    module.to(device);
+    auto start = std::chrono::steady_clock::now();
+    torch::jit::script::Module frozen = torch::jit::freeze(module);
+    torch::jit::script::Module optimized = freeze_only ? frozen : torch::jit::optimize_for_inference(frozen);
+    std::cout << (freeze_only ? "モデルをfreezeしました（" : "モデルを最適化しました（") << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s）" << std::endl;
+
+    //最適化したモデルを保存
+    try{
+        std::filesystem::create_directories(cache_dir);
+        optimized.save(cache_path.string());
+        std::cout << "最適化したモデルを保存しました：" << cache_path.string() << std::endl;
+    }
+    catch(const std::exception& e){
+        std::cerr << "最適化したモデルを保存できませんでした。キャッシュせずに続行します。" << std::endl
+                  << e.what() << std::endl;
+    }
+
+    return optimized;
+}
+
+//線形層の動的なint8量子化
+torch::jit::script::Module inference::quantize_dynamic_int8(const torch::jit::script::Module& module, IntType& num_quantized){
+    //量子化した線形層には逆伝播のカーネルがないため、forwardの中で微分するモデルは力を求められなくなる
+    if(calls_autograd(module)){
+        throw std::invalid_argument("モデルがforwardの中でtorch.autograd.gradを呼ぶため、int8量子化はできません（量子化した線形層は微分できません）。");
+    }
+
+    //freezeして、線形層の重みをグラフ上の定数にする（すでにfreeze済みの場合はそのまま使う）
+    torch::jit::script::Module frozen;
+    try{
+        frozen = torch::jit::freeze(module.clone());
+    }
+    catch(const c10::Error&){
+        frozen = module.clone();
+    }
+    std::shared_ptr<torch::jit::Graph> graph = frozen.get_method("forward").graph();
+
+    //重みのパック
+    const auto prepack = c10::Dispatcher::singleton().findSchemaOrThrow("quantized::linear_prepack", "");
+
+    //置き換える対象の線形層を集める（サブブロックも含む）
+    std::vector<torch::jit::Node*> targets;
+    std::function<void(torch::jit::Block*)> collect = [&](torch::jit::Block* block){
+        for(torch::jit::Node* node : block->nodes()){
+            for(torch::jit::Block* sub_block : node->blocks()){
+                collect(sub_block);
+            }
+            if(node->kind() != c10::Symbol::fromQualString("aten::linear")){
+                continue;
+            }
+            const auto weight = torch::jit::toIValue(node->input(1));
+            if(weight && weight->isTensor() && weight->toTensor().dim() == 2 && weight->toTensor().is_floating_point() && weight->toTensor().device().is_cpu()){
+                targets.push_back(node);
+            }
+        }
+    };
+    collect(graph->block());
+
+    num_quantized = 0;
+    for(torch::jit::Node* node : targets){
+        const torch::Tensor weight = torch::jit::toIValue(node->input(1))->toTensor().to(torch::kFloat32).contiguous();
+        const auto bias_iv = torch::jit::toIValue(node->input(2));
+        //バイアスが定数でない線形層は置き換えない
+        if(!bias_iv){
+            continue;
+        }
+        c10::optional<torch::Tensor> bias;
+        if(bias_iv->isTensor()){
+            bias = bias_iv->toTensor().to(torch::kFloat32).contiguous();
+        }
+
+        //出力チャネルごとの対称なスケールでint8に量子化
+        const torch::Tensor scales = (weight.abs().amax(1) / 127.0).clamp_min(1e-8).to(torch::kFloat64);
+        const torch::Tensor zero_points = torch::zeros({weight.size(0)}, torch::TensorOptions().dtype(torch::kInt64));
+        const torch::Tensor qweight = torch::quantize_per_channel(weight, scales, zero_points, 0, torch::kQInt8);
+
+        //quantized::linear_prepack(Tensor W, Tensor? B)
+        torch::jit::Stack stack{qweight, bias};
+        prepack.callBoxed(&stack);
+        const c10::IValue packed = stack[0];
+
+        //quantized::linear_dynamic(Tensor X, LinearPackedParamsBase W_prepack, bool reduce_range)に置き換える
+        torch::jit::WithInsertPoint guard(node);
+        torch::jit::Value* packed_value = graph->insertConstant(packed);
+        torch::jit::Value* reduce_range = graph->insertConstant(true);
+        torch::jit::Node* qnode = graph->create(c10::Symbol::fromQualString("quantized::linear_dynamic"), {node->input(0), packed_value, reduce_range});
+        qnode->insertBefore(node);
+        qnode->output()->setType(node->output()->type());
+        node->output()->replaceAllUsesWith(qnode->output());
+        node->destroy();
+        num_quantized ++;
+    }
+
+    //使われなくなったfloatの重みを除去
+    torch::jit::EliminateDeadCode(graph);
+
+    return frozen;
+}
+
+//2つのモデルの比較
+void inference::print_accuracy_report(Model& reference, Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace){
+    torch::Tensor x, edge_index, edge_weight;
+    std::tie(x, edge_index, edge_weight) = workspace.build(atoms, NL);
+
+    auto expected = reference.forward(x, edge_index, edge_weight);
+    auto actual = model.forward(x, edge_index, edge_weight);
+
+    const IntType N = x.size(0);
+    const torch::Tensor energy_ref = expected.first.to(torch::kFloat64).sum();
+    const torch::Tensor energy = actual.first.to(torch::kFloat64).sum();
+    const torch::Tensor force_ref = expected.second.to(torch::kFloat64);
+    const torch::Tensor force_diff = actual.second.to(torch::kFloat64) - force_ref;
+
+    const double energy_error = (energy - energy_ref).abs().item<double>();
+    const double force_rmse = force_diff.pow(2).mean().sqrt().item<double>();
+    const double force_max = force_diff.abs().max().item<double>();
+    const double force_scale = force_ref.pow(2).mean().sqrt().item<double>();
+
+    const double time_ref = benchmark_forward(reference, atoms, NL, workspace);
+    const double time = benchmark_forward(model, atoms, NL, workspace);
+
+    std::cout << "=====精度の比較=====" << std::endl
+              << "ポテンシャルの誤差: " << energy_error << " eV（" << energy_error / N * 1e3 << " meV/atom）" << std::endl
+              << "力のRMSE: " << force_rmse << " eV/Å（力のRMSに対して " << (force_scale > 0 ? 100.0 * force_rmse / force_scale : 0.0) << " %）" << std::endl
+              << "力の最大誤差: " << force_max << " eV/Å" << std::endl
+              << "1回の推論にかかる時間: " << time_ref << " ms → " << time << " ms" << std::endl;
+}
+
+//1回の推論にかかる時間の計測
+double inference::benchmark_forward(Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace, const IntType repeats, const IntType warmup){
+    torch::Tensor x, edge_index, edge_weight;
+    std::tie(x, edge_index, edge_weight) = workspace.build(atoms, NL);
+
+    double elapsed = 0.0;
+    for(IntType i = 0; i < warmup + repeats; i++){
+        auto start = std::chrono::steady_clock::now();
+        auto result = model.forward(x, edge_index, edge_weight);
+        //item()で同期して、CUDAでも推論の終了までを計測する
+        result.first.sum().item<double>();
+        if(i >= warmup){
+            elapsed += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    return repeats > 0 ? elapsed / repeats : 0.0;
+}
+
 //グラフの要素（テンソル）からの推論
-c10::ivalue::TupleElements inference::infer_from_tensor(torch::jit::script::Module& module, torch::Tensor x, torch::Tensor edge_index, torch::Tensor edge_weight){
+c10::ivalue::TupleElements inference::infer_from_tensor(torch::jit::script::Module& module, torch::Tensor x, torch::Tensor edge_index, torch::Tensor edge_weight, const bool inference_mode, const torch::Tensor& batch){
+    //モデルの入力（batchはモデルの省略可能な引数のため、定義されていて、forwardが受け取れる場合のみ渡す）
+    //forwardの引数はselfを含むため、batchを受け取るモデルは5つ以上の引数を持つ
+    std::vector<c10::IValue> inputs{x, edge_index, edge_weight};
+    if(batch.defined() && module.get_method("forward").function().getSchema().arguments().size() > 4){
+        inputs.push_back(batch);
+    }
+
     //モデルの推論
-    module.eval();
     try{
-        auto result_iv = module.forward({x, edge_index, edge_weight});
+        c10::IValue result_iv;
+        if(inference_mode){
+            //勾配の計算に必要な情報（autogradのメタデータ）を作らずに推論する
+            c10::InferenceMode guard;
+            result_iv = module.forward(inputs);
+        }
+        else{
+            result_iv = module.forward(inputs);
+        }
         auto result_tuple = result_iv.toTuple();
 
         auto elements = result_tuple->elements();
@@ -46,34 +294,50 @@ c10::ivalue::TupleElements inference::infer_from_tensor(torch::jit::script::Modu
 }
 
 //cutoff距離以内にある原子のペアを探す
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> inference::RadiusInteractionGraph(Atoms& atoms, torch::Tensor cutoff){
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> inference::RadiusInteractionGraph(Atoms& atoms, torch::Tensor cutoff, const IntType block_size){
     torch::Tensor pos = atoms.positions();
     const torch::Tensor Lbox = atoms.box_size();
     const torch::Tensor Linv = 1 / Lbox;
-    
-    //距離の計算
-    torch::Tensor diff_position = pos.unsqueeze(1) - pos.unsqueeze(0);  //(N, N, 3)
-    diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
-    
-    //距離の2乗
-    torch::Tensor dist2 = torch::sum(diff_position.pow(2), 2);  //(N, N)
-
-    //マスク
-    torch::Tensor mask = dist2 < cutoff.pow(2);
-    //i = jを除外
-    mask.fill_diagonal_(0);
-
-    //インデックスの取得
-    auto indices = torch::where(mask);
-    torch::Tensor source_index = indices[0].to(kIntType);   //(num_edges, )
-    torch::Tensor target_index = indices[1].to(kIntType);   //(num_edges, )
+    const IntType N = pos.size(0);
+    //ブロックの行数（0以下ならブロックに分けない）
+    const IntType block = block_size > 0 ? block_size : std::max<IntType>(N, 1);
+
+    std::vector<torch::Tensor> source_indices;
+    std::vector<torch::Tensor> target_indices;
+    std::vector<torch::Tensor> distance_vectors_list;
+
+    //(block, N)ずつ処理することで、メモリ使用量をO(block * N)に抑える
+    for(IntType begin = 0; begin < N; begin += block){
+        const IntType end = std::min(begin + block, N);
+        torch::Tensor rows = pos.slice(0, begin, end);  //(B, 3)
+
+        //距離の計算
+        torch::Tensor diff_position = rows.unsqueeze(1) - pos.unsqueeze(0);  //(B, N, 3)
+        diff_position -= Lbox * torch::floor(diff_position * Linv + 0.5);
+
+        //距離の2乗
+        torch::Tensor dist2 = torch::sum(diff_position.pow(2), 2);  //(B, N)
+
+        //マスク
+        torch::Tensor mask = dist2 < cutoff.pow(2);
+        //i = jを除外（ブロック内ではbegin列だけずれた対角成分）
+        mask.diagonal(begin).fill_(0);
+
+        //インデックスの取得
+        auto indices = torch::where(mask);
+        torch::Tensor row_index = indices[0].to(kIntType);
+        torch::Tensor target_index = indices[1].to(kIntType);
+
+        //距離ベクトルの作成
+        //2つのインデックスの組み合わせからインデックスを取得
+        distance_vectors_list.push_back(- diff_position.index({row_index, target_index}));   //(num_edges, 3)
+        source_indices.push_back(row_index + begin);
+        target_indices.push_back(target_index);
+    }
 
     //インデックスを一つのtorch::Tensorにまとめる
-    torch::Tensor edge_index = torch::stack({source_index, target_index});
-
-    //距離ベクトルの作成
-    //2つのインデックスの組み合わせからインデックスを取得
-    torch::Tensor distance_vectors = - diff_position.index({source_index, target_index}); //(num_edges, 3)
+    torch::Tensor edge_index = torch::stack({torch::cat(source_indices), torch::cat(target_indices)});
+    torch::Tensor distance_vectors = torch::cat(distance_vectors_list);
 
     //各原子の原子番号を取得
     torch::Tensor x = atoms.atomic_numbers();
@@ -84,104 +348,228 @@ std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> inference::RadiusInterac
 
 //NLを使う場合
 std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> inference::RadiusInteractionGraph(Atoms& atoms, NeighbourList NL){
-    torch::Tensor pos = atoms.positions();
-    const torch::Tensor Lbox = atoms.box_size();
-    const torch::Tensor Linv = 1 / Lbox;
-
-    //読み込んだインデックスの原子から、距離を計算
-    const torch::Tensor source_pos = pos.index({NL.source_index()});
-    const torch::Tensor target_pos = pos.index({NL.target_index()});
-
-    //距離の計算
-    torch::Tensor diff_pos_vec = source_pos - target_pos;
-    diff_pos_vec -= Lbox * torch::floor(diff_pos_vec * Linv + 0.5);
-
-    //実際のカットオフ距離でフィルタリング
-    torch::Tensor dist2 = torch::sum(diff_pos_vec.pow(2), 1);
-    torch::Tensor cutoff2 = NL.cutoff().pow(2);
-
-    torch::Tensor mask = torch::lt(dist2, cutoff2); //dist2 < cutoff2
-
-    torch::Tensor source_index = NL.source_index().index({mask});
-    torch::Tensor target_index = NL.target_index().index({mask});
-    torch::Tensor distance_vectors = - diff_pos_vec.index({mask});
+    //実際のカットオフ距離の2乗
+    //モデルは学習したカットオフ距離以内のすべてのエッジを使うため、それより短い原子種ペアごとのカットオフ距離は使えない
+    if(NL.has_pair_cutoffs() && (NL.pair_cutoffs() < NL.cutoff()).any().item<bool>()){
+        throw std::invalid_argument("モデルで推論する場合、原子種ペアごとのカットオフ距離をcutoffより短くすることはできません（モデルのエッジが欠けるため）。");
+    }
+    const torch::Tensor cutoff2 = NL.cutoff().pow(2);
 
-    //インデックスを一つのtorch::Tensorにまとめる
-    torch::Tensor edge_index = torch::stack({source_index, target_index});
+    //距離の計算・周期境界条件の適用・カットオフ距離でのフィルタリングを1回で行う
+    //ハーフリストの場合は、フィルタリング後のペアを両方向に展開したものが返る
+    torch::Tensor edge_index, distance_vectors;
+    std::tie(edge_index, distance_vectors) = graph_ops::radius_filter(atoms.positions(), atoms.box_size(), NL.source_index(), NL.target_index(), cutoff2, NL.is_half());
 
     //各原子の原子番号を取得
     torch::Tensor x = atoms.atomic_numbers();
-    
+
     return std::make_tuple(x, edge_index, distance_vectors);
 }
 
 //一つの構造に対して、エネルギーと力を計算
-void inference::calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, torch::Tensor cutoff){
+void inference::calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, torch::Tensor cutoff, const IntType block_size){
     //グラフ構造を保存する変数
     torch::Tensor x, edge_index, edge_weight;
 
     //原子をグラフに変換
-    std::tie(x, edge_index, edge_weight) = RadiusInteractionGraph(atoms, cutoff);
+    std::tie(x, edge_index, edge_weight) = RadiusInteractionGraph(atoms, cutoff, block_size);
 
     //推論
     auto result = infer_from_tensor(module, x, edge_index, edge_weight);
 
     //力を各原子にセット
-    torch::Tensor forces = result[1].toTensor().to(kRealType);
+    torch::Tensor forces = result[1].toTensor().detach().to(kRealType);
     atoms.set_forces(forces);
 
     //ポテンシャルをセット
-    torch::Tensor energy = result[0].toTensor().to(kRealType);
+    torch::Tensor energy = result[0].toTensor().detach().to(kRealType);
     atoms.set_potential_energy(energy);
 }
 
 //隣接リストを使う場合
-void inference::calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, NeighbourList NL){
+void inference::calc_energy_and_force_MLP(torch::jit::script::Module& module, Atoms& atoms, NeighbourList& NL){
     //グラフ構造を保存する変数
     torch::Tensor x, edge_index, edge_weight;
 
     //原子をグラフに変換
+    auto start = std::chrono::steady_clock::now();
     std::tie(x, edge_index, edge_weight) = RadiusInteractionGraph(atoms, NL);
 
-    //推論
+    //マージンの自動調整のため、グラフ構築の時間を記録
+    //マスクによるインデックス付けで同期しているため、CUDAでもおおよその時間が得られる
+    if(NL.auto_margin()){
+        NL.record_graph_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    //推論（モデルがforwardの中で微分する場合があるため、勾配は有効にする）
     auto result = infer_from_tensor(module, x, edge_index, edge_weight);
 
     //力を各原子にセット
-    torch::Tensor forces = result[1].toTensor().to(kRealType).detach(); //メモリ不足対策に、detach()して、計算グラフから切り離す。
+    //モデルの中で作られた計算グラフを速度・位置の更新に持ち込まないよう、切り離す
+    torch::Tensor forces = result[1].toTensor().detach().to(kRealType);
     atoms.set_forces(forces);
 
     //ポテンシャルをセット
-    torch::Tensor energy = result[0].toTensor().to(kRealType).detach(); //メモリ不足対策に、detach()して、計算グラフから切り離す。
+    torch::Tensor energy = result[0].toTensor().detach().to(kRealType);
     atoms.set_potential_energy(energy);
 }
 
+//隣接リストと作業領域を使う場合
+void inference::calc_energy_and_force_MLP(Model& model, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace){
+    //グラフ構造を保存する変数
+    torch::Tensor x, edge_index, edge_weight;
+
+    //原子をグラフに変換（作業領域のバッファに書き込む）
+    auto start = std::chrono::steady_clock::now();
+    std::tie(x, edge_index, edge_weight) = workspace.build(atoms, NL);
+
+    //マージンの自動調整のため、グラフ構築の時間を記録
+    //nonzeroで同期しているため、CUDAでもおおよその時間が得られる
+    if(NL.auto_margin()){
+        NL.record_graph_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    //推論
+    auto result = model.forward(x, edge_index, edge_weight);
+
+    //力を各原子にセット
+    //Model::forwardは計算グラフから切り離した値を返すため、detach()は不要
+    //部分グラフの場合は、系全体の原子の並びに戻す
+    torch::Tensor forces = workspace.scatter_to_atoms(result.second.to(kRealType));
+    atoms.set_forces(forces);
+
+    //ポテンシャルをセット
+    torch::Tensor energy = result.first.to(kRealType);
+    atoms.set_potential_energy(energy);
+}
+
+//コミッティの力のばらつき
+torch::Tensor inference::committee_force_deviation(std::vector<Model>& committee, const torch::Tensor& reference_forces, const GraphWorkspace& workspace){
+    //基準の力を求めたときのグラフを使い回す
+    const auto& [x, edge_index, edge_weight] = workspace.last_graph();
+    TORCH_CHECK(x.defined(), "コミッティの推論の前に、作業領域でグラフを作成する必要があります。");
+
+    //(M, N, 3)に並べる
+    std::vector<torch::Tensor> forces;
+    forces.reserve(committee.size() + 1);
+    forces.push_back(reference_forces.detach());
+    for(Model& model : committee){
+        //同じ入力に対して推論する（InferenceModeを使えるかはモデルごとに判定される）
+        forces.push_back(workspace.scatter_to_atoms(model.forward(x, edge_index, edge_weight).second.to(kRealType)));
+    }
+    torch::Tensor stacked = torch::stack(forces);
+
+    //原子ごとの標準偏差の最大値
+    torch::Tensor deviation = (stacked - stacked.mean(0, /*keepdim=*/true)).pow(2).sum(2).mean(0).sqrt();
+    //固定原子がある場合は、可動原子のみを見る（部分グラフの境界の固定原子の力は正確でないため）
+    if(workspace.mobile().defined()){
+        deviation = deviation.masked_fill(workspace.mobile().logical_not(), 0.0);
+    }
+    return deviation.max();
+}
+
+//複数の系をまとめて推論
+bool inference::calc_energy_and_force_MLP_batched(Model& model, std::vector<Atoms>& atoms, std::vector<NeighbourList>& NLs, std::vector<GraphWorkspace>& workspaces){
+    const IntType K = static_cast<IntType>(atoms.size());
+
+    std::vector<torch::Tensor> xs, edge_indices, edge_weights;
+    std::vector<int64_t> num_atoms;
+    IntType offset = 0;     //原子番号の累積和
+
+    //各系のグラフを作り、エッジのインデックスをずらす
+    for(IntType k = 0; k < K; k++){
+        torch::Tensor x, edge_index, edge_weight;
+        auto start = std::chrono::steady_clock::now();
+        std::tie(x, edge_index, edge_weight) = workspaces[k].build(atoms[k], NLs[k]);
+        //マージンの自動調整のため、系ごとのグラフ構築の時間を記録
+        if(NLs[k].auto_margin()){
+            NLs[k].record_graph_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        xs.push_back(x);
+        edge_indices.push_back(edge_index + offset);
+        edge_weights.push_back(edge_weight);
+        num_atoms.push_back(x.size(0));
+        offset += x.size(0);
+    }
+
+    //各原子が属する系の番号を渡し、系ごとのポテンシャル (K, )を返させる
+    const torch::Tensor x_all = torch::cat(xs);
+    const torch::Tensor counts = torch::tensor(num_atoms, torch::TensorOptions().dtype(kIntType).device(x_all.device()));
+    const torch::Tensor batch = torch::repeat_interleave(torch::arange(K, counts.options()), counts);
+
+    //1つの非連結なグラフとして推論
+    auto result = model.forward(x_all, torch::cat(edge_indices, 1), torch::cat(edge_weights), true, batch);
+
+    //力を各系に振り分ける
+    std::vector<torch::Tensor> forces = result.second.to(kRealType).split_with_sizes(num_atoms);
+    for(IntType k = 0; k < K; k++){
+        atoms[k].set_forces(forces[k]);
+    }
+
+    //ポテンシャルを各系に振り分ける
+    torch::Tensor energy = result.first.to(kRealType);
+    if(energy.numel() == K){
+        //系ごとの値
+        energy = energy.reshape({K});
+        for(IntType k = 0; k < K; k++){
+            atoms[k].set_potential_energy(energy[k]);
+        }
+        return true;
+    }
+    if(energy.numel() == offset){
+        //原子ごとの値
+        std::vector<torch::Tensor> energies = energy.reshape({offset}).split_with_sizes(num_atoms);
+        for(IntType k = 0; k < K; k++){
+            atoms[k].set_potential_energy(energies[k].sum());
+        }
+        return true;
+    }
+
+    //全体で1つの値の場合は、系ごとに分けられない
+    return false;
+}
+
 //エネルギーのみをMLPを用いて計算し、力をその微分から求める
-void inference::infer_energy_with_MLP_and_clac_force(torch::jit::script::Module& module, Atoms& atoms, NeighbourList NL){
+void inference::infer_energy_with_MLP_and_clac_force(torch::jit::script::Module& module, Atoms& atoms, NeighbourList& NL, GraphWorkspace& workspace, const bool calc_virial){
     torch::Tensor x, edge_index, edge_weight;
-    std::tie(x, edge_index, edge_weight) = RadiusInteractionGraph(atoms, NL);
+    std::tie(x, edge_index, edge_weight) = workspace.build(atoms, NL);
     //後で微分を使うためedge_weightのrequires_gradをtrueにする
-    edge_weight.requires_grad_(true);
-    //推論
-    auto result = infer_from_tensor(module, x, edge_index, edge_weight);
-    //ポテンシャルを取得
-    torch::Tensor energy = result[0].toTensor().to(kRealType);
-    
-    //力を計算
-    //torch::autograd::grad()の引数、戻り値はtorch::TensorList
-    torch::Tensor diff_ij = torch::autograd::grad({energy}, {edge_weight})[0];
-    //(N, 3)のゼロテンソルを作成
-    torch::Tensor force_i = torch::zeros({x.size(0), 3}, torch::TensorOptions().dtype(kRealType));
-    torch::Tensor force_j = torch::zeros({x.size(0), 3}, torch::TensorOptions().dtype(kRealType));
-    //diff_ijを加算
-    force_i.index_add_(0, edge_index[0], diff_ij);
-    force_j.index_add_(0, edge_index[1], -diff_ij);
+    //作業領域のバッファと記憶領域を共有したまま、勾配を求める葉にする
+    edge_weight = edge_weight.detach().requires_grad_(true);
 
-    torch::Tensor force = force_i + force_j;
+    //推論（微分するため、InferenceModeを使わない）
+    torch::Tensor energy;
+    try{
+        c10::IValue result_iv = module.forward({x, edge_index, edge_weight});
+        //エネルギーのみを返すモデルと、(ポテンシャル, ...)のタプルを返すモデルの両方に対応する
+        energy = result_iv.isTuple() ? result_iv.toTuple()->elements()[0].toTensor() : result_iv.toTensor();
+    }
+    catch(const c10::Error& e){
+        std::cerr << "モデルの推論に失敗しました。" << std::endl
+                  << e.what() << std::endl;
+        throw;
+    }
+    //原子ごとの値の場合は和をとる
+    energy = energy.to(kRealType).sum();
 
-    energy = energy.detach();
-    force = force.detach();
+    //力を計算
+    //逆伝播の後に計算グラフを解放する（retain_graph = false）
+    torch::Tensor diff_ij = torch::autograd::grad({energy}, {edge_weight}, /*grad_outputs=*/{}, /*retain_graph=*/false, /*create_graph=*/false)[0];
+
+    //ソース原子に+diff_ij、ターゲット原子に-diff_ijを、1回のindex_add_でまとめて加算する
+    //edge_indexは(2, num_edges)なので、平坦にすると[ソース, ターゲット]の順に並ぶ
+    //パディングのダミーのエッジは原子0の自己ループのため、加算すると打ち消し合う
+    torch::Tensor force = torch::zeros({x.size(0), 3}, diff_ij.options());
+    force.index_add_(0, edge_index.reshape({-1}), torch::cat({diff_ij, diff_ij.neg()}));
+    //部分グラフの場合は、系全体の原子の並びに戻す
+    force = workspace.scatter_to_atoms(force);
+
+    //同じ勾配からビリアルを計算 W = -Σ r_ij ⊗ ∂E/∂r_ij
+    if(calc_virial){
+        atoms.set_virial(-torch::mm(edge_weight.detach().t(), diff_ij));
+    }
 
     //力とポテシャルを原子にセット
-    atoms.set_potential_energy(energy);
+    atoms.set_potential_energy(energy.detach());
     atoms.set_forces(force);
-}
\ No newline at end of file
+}
@@ -1,11 +1,16 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <vector>
 #include <chrono>
+#include <memory>
 
 #include "Command.hpp"
 #include "ConfigReader.hpp"
 #include "MD.hpp"
+#include "ReplicaMD.hpp"
+#include "threading.hpp"
 
 //文字列をboolに変換
 bool string_to_bool(const std::string& s) {
@@ -15,6 +20,21 @@ bool string_to_bool(const std::string& s) {
     return b;
 }
 
+//カンマ区切りの文字列を分割（前後の空白は除去し、空の要素は除く）
+std::vector<std::string> split_list(const std::string& s) {
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
 //コマンドの実行
 template <typename ThermostatType>
 void execute_command(std::vector<Command> commands, MD& md, ThermostatType& thermostat, const RealType& dt) {
@@ -60,6 +80,10 @@ void execute_command(std::vector<Command> commands, MD& md, ThermostatType& ther
                 md.NVE(tsim, temp, step, is_save_traj);
             }
 
+            md.print_NL_statistics();
+            md.print_committee_statistics();
+            md.print_incremental_statistics();
+
             const std::string& save_path = cmd.redirect_target;
             if (!save_path.empty()) {
                 md.save_atoms(save_path);
@@ -112,6 +136,10 @@ void execute_command(std::vector<Command> commands, MD& md, ThermostatType& ther
                 md.NVT(tsim, thermostat, step, is_save_traj);
             }
 
+            md.print_NL_statistics();
+            md.print_committee_statistics();
+            md.print_incremental_statistics();
+
             const std::string& save_path = cmd.redirect_target;
             if (!save_path.empty()) {
                 md.save_atoms(save_path);
@@ -168,6 +196,10 @@ void execute_command(std::vector<Command> commands, MD& md, ThermostatType& ther
                 md.NVT_anneal(cooling_rate, thermostat, target_temp, step, is_save_traj);
             }
 
+            md.print_NL_statistics();
+            md.print_committee_statistics();
+            md.print_incremental_statistics();
+
             const std::string& save_path = cmd.redirect_target;
             if (!save_path.empty()) {
                 md.save_atoms(save_path);
@@ -181,6 +213,71 @@ void execute_command(std::vector<Command> commands, MD& md, ThermostatType& ther
     }
 }
 
+//レプリカをまとめて実行する場合のコマンドの実行
+template <typename ThermostatType>
+void execute_replica_commands(std::vector<Command> commands, ReplicaMD& md, std::vector<ThermostatType>& thermostats, const RealType& dt) {
+    for (const auto& cmd : commands) {
+        std::cout << "=====" << cmd.name << "=====" << std::endl;
+        auto args = cmd.args;
+        if (cmd.name == "SAVE") {
+            std::string output_path = args.count("output") ? args.at("output") : "saved_structure.xyz";
+            md.save_atoms(output_path);
+            std::cout << ReplicaMD::replica_path(output_path, 0) << "などに構造を保存しました。" << std::endl;
+        }
+        else if (cmd.name == "RESET_STEP") {
+            md.reset_step();
+            std::cout << "ステップ数を0に初期化しました。" << std::endl;
+        }
+        else if (cmd.name == "INIT_TEMP") {
+            const RealType temp = std::stod(args.at("temp"));
+            md.init_temp(temp);
+            std::cout << "温度を" << temp << " Kで初期化しました。" << std::endl;
+        }
+        else if (cmd.name == "NVT") {
+            const RealType tsim = std::stod(args.at("duration"));
+            const RealType temp = std::stod(args.at("temp"));
+            const std::string output_method = args.at("output_method");
+            const bool is_save_traj = args.count("trajectory") ? string_to_bool(args.at("trajectory")) : false;
+
+            //熱浴の温度を設定
+            for (auto& thermostat : thermostats) {
+                thermostat.set_temp(temp);
+            }
+
+            if (args.count("init_temp")) {
+                md.init_temp(std::stod(args.at("init_temp")));
+            }
+
+            std::cout << "シミュレーション時間: " << tsim << " fs\n"
+                      << "ステップ数: " << tsim / dt << "\n"
+                      << "温度: " << temp << " K\n"
+                      << "レプリカ数: " << md.num_replicas() << "\n"
+                      << "保存間隔: " << output_method << "\n"
+                      << "トラジェクトリの保存: " << is_save_traj << std::endl;
+
+            if (output_method == "log") {
+                md.NVT(tsim, thermostats, output_method, is_save_traj);
+            }
+            else {
+                const IntType step = std::stoi(output_method);
+                md.NVT(tsim, thermostats, step, is_save_traj);
+            }
+
+            md.print_NL_statistics();
+
+            const std::string& save_path = cmd.redirect_target;
+            if (!save_path.empty()) {
+                md.save_atoms(save_path);
+                std::cout << ReplicaMD::replica_path(save_path, 0) << "などに構造を保存しました。" << std::endl;
+            }
+        }
+        else {
+            std::cerr << "レプリカをまとめて実行する場合は未対応のコマンド: " << cmd.name << "をスキップしました。" << std::endl;
+            continue;
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         std::cerr << "設定ファイルを指定してください。" << std::endl;
@@ -200,9 +297,51 @@ int main(int argc, char* argv[]) {
         const RealType dt = variables.count("dt") ? std::stod(variables.at("dt")) : 0.5;
         const RealType cutoff = variables.count("cutoff") ? std::stod(variables.at("cutoff")) : 5.0;
         const RealType margin = variables.count("margin") ? std::stod(variables.at("margin")) : 1.0;
+        const std::string NL_method = variables.count("NL_method") ? variables.at("NL_method") : "auto";
+        const IntType NL_cell_threshold = variables.count("NL_cell_threshold") ? std::stol(variables.at("NL_cell_threshold")) : 5000;
+        const bool NL_half = variables.count("NL_half") ? string_to_bool(variables.at("NL_half")) : false;
+        const std::string pair_cutoffs = variables.count("pair_cutoffs") ? variables.at("pair_cutoffs") : "";
+        const IntType NL_block_size = variables.count("NL_block_size") ? std::stol(variables.at("NL_block_size")) : 2048;
+        const bool NL_sort_by_distance = variables.count("NL_sort_by_distance") ? string_to_bool(variables.at("NL_sort_by_distance")) : false;
+        const bool margin_auto = variables.count("margin_auto") ? string_to_bool(variables.at("margin_auto")) : false;
+        const RealType margin_min = variables.count("margin_min") ? std::stod(variables.at("margin_min")) : 0.3;
+        const RealType margin_max = variables.count("margin_max") ? std::stod(variables.at("margin_max")) : 3.0;
+        const std::string model_backend = variables.count("model_backend") ? variables.at("model_backend") : "torchscript";
+        const bool model_optimize = variables.count("model_optimize") ? string_to_bool(variables.at("model_optimize")) : false;
+        const std::string model_cache_dir = variables.count("model_cache_dir") ? variables.at("model_cache_dir") : "./models/cache";
+        const bool edge_padding = variables.count("edge_padding") ? string_to_bool(variables.at("edge_padding")) : false;
+        const bool model_quantize = variables.count("model_quantize") ? string_to_bool(variables.at("model_quantize")) : false;
+        const IntType warmup_steps = variables.count("warmup_steps") ? std::stol(variables.at("warmup_steps")) : 3;
+        const std::string force_provider = variables.count("force_provider") ? variables.at("force_provider") : "model";   //"model"または"LJ"
+        const bool autograd_force = variables.count("autograd_force") ? string_to_bool(variables.at("autograd_force")) : false;
+        const bool calc_virial = variables.count("virial") ? string_to_bool(variables.at("virial")) : false;
+        //コミッティ（シミュレーションに使うモデル以外のモデルのパスをカンマ区切りで指定）
+        const std::vector<std::string> committee_models = variables.count("committee_models") ? split_list(variables.at("committee_models")) : std::vector<std::string>();
+        const RealType committee_threshold = variables.count("committee_threshold") ? std::stod(variables.at("committee_threshold")) : 0.2;
+        const std::string committee_dump_path = variables.count("committee_dump_path") ? variables.at("committee_dump_path") : "./extrapolation.xyz";
+        //固定原子（元素記号・番号の範囲・座標の範囲のいずれかに当てはまる原子）
+        const std::string frozen_species = variables.count("frozen_species") ? variables.at("frozen_species") : "";      //例: "Si,O"
+        const std::string frozen_indices = variables.count("frozen_indices") ? variables.at("frozen_indices") : "";      //例: "0-99,200"
+        const std::string frozen_region = variables.count("frozen_region") ? variables.at("frozen_region") : "";        //例: "z -20.0 -5.0"（軸・下限・上限）
+        const IntType subgraph_hops = variables.count("subgraph_hops") ? std::stol(variables.at("subgraph_hops")) : 0;
+        //差分推論（incremental_toleranceが正のとき有効）
+        const RealType incremental_tolerance = variables.count("incremental_tolerance") ? std::stod(variables.at("incremental_tolerance")) : 0.0;
+        const IntType incremental_interval = variables.count("incremental_interval") ? std::stol(variables.at("incremental_interval")) : 10;
+        const IntType incremental_hops = variables.count("incremental_hops") ? std::stol(variables.at("incremental_hops")) : 6;
+        const bool NL_speculative = variables.count("NL_speculative") ? string_to_bool(variables.at("NL_speculative")) : false;
+        const RealType NL_speculative_extra = variables.count("NL_speculative_extra") ? std::stod(variables.at("NL_speculative_extra")) : 0.5;
+        const RealType NL_speculative_trigger = variables.count("NL_speculative_trigger") ? std::stod(variables.at("NL_speculative_trigger")) : 0.7;
 
         const std::string trajectory_path = variables.count("trajectory_path") ? variables.at("trajectory_path") : "./trajectory.xyz";
         const std::string thermostat_type = variables.count("thermostat_type") ? variables.at("thermostat_type") : "Bussi";
+        const IntType replicas = variables.count("replicas") ? std::stol(variables.at("replicas")) : 1;
+
+        //CPUのスレッド数・コアの割り当て・メモリ配置（libtorchのスレッドが作られる前に設定する）
+        const IntType num_threads = variables.count("num_threads") ? std::stol(variables.at("num_threads")) : 0;
+        const IntType num_interop_threads = variables.count("num_interop_threads") ? std::stol(variables.at("num_interop_threads")) : 0;
+        const std::string cpu_affinity = variables.count("cpu_affinity") ? variables.at("cpu_affinity") : "";
+        const bool numa_bind = variables.count("numa_bind") ? string_to_bool(variables.at("numa_bind")) : false;
+        threading::configure(num_threads, num_interop_threads, cpu_affinity, numa_bind);
 
         //必須の値
         const std::string model_path = variables.at("model_path");
@@ -210,35 +349,165 @@ int main(int argc, char* argv[]) {
 
         torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
 
-        MD md(dt, cutoff, margin, initial_path, model_path, device);
+        if (replicas > 1) {
+            //独立なレプリカを1つのプロセスで実行し、推論をまとめて行う
+            //初期構造はカンマ区切りでレプリカごとに指定できる（1つならすべてのレプリカで共通）
+            ReplicaMD md(replicas, dt, cutoff, margin, split_list(initial_path), model_path, device, model_backend);
+
+            md.set_traj_path(trajectory_path);
+            md.set_edge_padding(edge_padding);
+            md.configure_NL([&](NeighbourList& NL) {
+                NL.set_method(NL_method);
+                NL.set_cell_threshold(NL_cell_threshold);
+                NL.set_half(NL_half);
+                if (!pair_cutoffs.empty()) {
+                    NL.set_pair_cutoffs(NeighbourList::parse_pair_cutoffs(pair_cutoffs));
+                }
+                NL.set_block_size(NL_block_size);
+                NL.set_sort_by_distance(NL_sort_by_distance);
+                NL.set_auto_margin(margin_auto, margin_min, margin_max);
+                NL.set_speculative(NL_speculative, NL_speculative_extra, NL_speculative_trigger);
+            });
+
+            std::cout << "=====全体の設定=====" << std::endl
+                      << "初期構造: " << initial_path << std::endl
+                      << "モデル: " << model_path << "（バックエンド: " << model_backend << "）" << std::endl
+                      << "レプリカ数: " << replicas << std::endl
+                      << "エッジ数のパディング: " << std::boolalpha << edge_padding << std::endl
+                      << "タイムステップ: " << dt << " fs" << std::endl
+                      << "カットオフ距離: " << cutoff << " Å" << std::endl
+                      << "マージン: " << margin << " Å" << std::endl
+                      << "熱浴の種類: " << thermostat_type << std::endl
+                      << "トラジェクトリの保存先: " << ReplicaMD::replica_path(trajectory_path, 0) << "など" << std::endl;
+
+            //熱浴はtorch::Tensorを共有しないよう、レプリカごとに作る
+            if (thermostat_type == "Bussi") {
+                const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : 1.0;
+                std::vector<BussiThermostat> thermostats;
+                for (IntType k = 0; k < replicas; k++) {
+                    thermostats.emplace_back(0.0, tau, device);
+                }
+
+                execute_replica_commands(commands, md, thermostats, dt);
+            }
 
-        md.set_traj_path(trajectory_path);
+            if (thermostat_type == "NoseHoover") {
+                const IntType chain_length = variables.count("chain_length") ? std::stoi(variables.at("chain_length")) : 1;
+                const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : dt * 1e+3;
+                std::vector<NoseHooverThermostat> thermostats;
+                for (IntType k = 0; k < replicas; k++) {
+                    thermostats.emplace_back(chain_length, 0.0, tau, device);
+                }
 
-        //設定を出力
-        std::cout << "=====全体の設定=====" << std::endl 
-                  << "初期構造: " << initial_path << std::endl
-                  << "モデル: " << model_path << std::endl
-                  << "タイムステップ: " << dt << " fs" << std::endl
-                  << "カットオフ距離: " << cutoff << " Å" << std::endl
-                  << "マージン: " << margin << " Å" << std::endl
-                  << "熱浴の種類: " << thermostat_type << std::endl;
+                execute_replica_commands(commands, md, thermostats, dt);
+            }
+        }
+        else {
+            MD md(dt, cutoff, margin, initial_path, model_path, device, model_backend);
 
-        std::cout << "=====出力設定=====" << std::endl
-                  << "トラジェクトリの保存先: " << trajectory_path << std::endl;
+            md.set_traj_path(trajectory_path);
+            md.set_NL_method(NL_method, NL_cell_threshold);
+            md.set_NL_half(NL_half);
+            if (!pair_cutoffs.empty()) {
+                md.set_NL_pair_cutoffs(pair_cutoffs);
+            }
+            md.set_NL_block_size(NL_block_size);
+            md.set_NL_sort_by_distance(NL_sort_by_distance);
+            md.set_NL_auto_margin(margin_auto, margin_min, margin_max);
+            md.set_autograd_force(autograd_force);
+            if (force_provider == "LJ") {
+                md.set_force_provider(std::make_unique<LJForceProvider>());
+            }
+            else if (force_provider == "model") {
+                md.set_force_provider(nullptr);
+            }
+            else {
+                throw std::invalid_argument("force_providerは\"model\", \"LJ\"のいずれかである必要があります。");
+            }
+            md.set_calc_virial(calc_virial);
+            md.set_committee(committee_models, committee_threshold, committee_dump_path);
+            md.set_incremental(incremental_tolerance, incremental_interval, incremental_hops);
+            if (!frozen_species.empty() || !frozen_indices.empty() || !frozen_region.empty()) {
+                const Atoms& atoms = md.atoms();
+                torch::Tensor frozen = torch::zeros({atoms.size().item<IntType>()}, torch::TensorOptions().device(atoms.device()).dtype(torch::kBool));
+                if (!frozen_species.empty()) {
+                    frozen |= atoms.select_by_species(split_list(frozen_species));
+                }
+                for (const std::string& range : split_list(frozen_indices)) {
+                    const auto dash = range.find('-');
+                    const IntType first = std::stol(range.substr(0, dash));
+                    const IntType last = dash == std::string::npos ? first : std::stol(range.substr(dash + 1));
+                    frozen |= atoms.select_by_index(first, last);
+                }
+                if (!frozen_region.empty()) {
+                    std::stringstream ss(frozen_region);
+                    std::string axis;
+                    RealType lower, upper;
+                    if (!(ss >> axis >> lower >> upper) || std::string("xyz").find(axis) == std::string::npos || axis.size() != 1) {
+                        throw std::invalid_argument("frozen_regionは\"軸 下限 上限\"（例: \"z -20.0 -5.0\"）の形式で指定してください。");
+                    }
+                    frozen |= atoms.select_by_region(static_cast<IntType>(std::string("xyz").find(axis)), lower, upper);
+                }
+                md.set_frozen(frozen, subgraph_hops);
+                std::cout << "固定原子: " << frozen.sum().item<IntType>() << " 個（部分グラフのホップ数: " << subgraph_hops << "）" << std::endl;
+            }
+            md.set_edge_padding(edge_padding);
+            md.set_NL_speculative(NL_speculative, NL_speculative_extra, NL_speculative_trigger);
+
+            //設定を出力
+            std::cout << "=====全体の設定=====" << std::endl 
+                      << "初期構造: " << initial_path << std::endl
+                      << "モデル: " << model_path << std::endl
+                      << "タイムステップ: " << dt << " fs" << std::endl
+                      << "モデルのバックエンド: " << model_backend << std::endl
+                      << "モデルの最適化: " << std::boolalpha << model_optimize << "（キャッシュ: " << model_cache_dir << "）" << std::endl
+                      << "エッジ数のパディング: " << std::boolalpha << edge_padding << std::endl
+                      << "int8量子化: " << model_quantize << std::endl
+                      << "ウォームアップの推論: " << warmup_steps << " 回" << std::endl
+                      << "力の計算方法: " << force_provider << std::endl
+                      << "力の計算: " << (autograd_force ? "エネルギーの微分" : "モデルの出力（モデルがforwardで微分しなければInferenceMode）") << std::endl
+                      << "コミッティ: " << (committee_models.empty() ? "なし" : std::to_string(committee_models.size() + 1) + " モデル（閾値: " + std::to_string(committee_threshold) + " eV/Å、保存先: " + committee_dump_path + "）") << std::endl
+                      << "差分推論: " << (incremental_tolerance > 0 ? "許容変位 " + std::to_string(incremental_tolerance) + " Å、" + std::to_string(incremental_interval) + " 回に1回全体を推論、受容野 " + std::to_string(incremental_hops) + " ホップ" : "なし") << std::endl
+                      << "ビリアル・圧力の計算: " << (calc_virial && autograd_force ? "あり" : (calc_virial ? "なし（autograd_forceが必要）" : "なし")) << std::endl
+                      << "カットオフ距離: " << cutoff << " Å" << std::endl
+                      << "マージン: " << margin << " Å" << std::endl
+                      << "マージンの自動調整: " << std::boolalpha << margin_auto << "（" << margin_min << " - " << margin_max << " Å）" << std::endl
+                      << "隣接リストの構築方法: " << NL_method << "（セルリストの閾値: " << NL_cell_threshold << " 原子、全ペアのブロック: " << NL_block_size << " 行）" << std::endl
+                      << "ハーフリスト: " << std::boolalpha << NL_half << std::endl
+                      << "原子種ペアごとのカットオフ距離: " << (pair_cutoffs.empty() ? "なし" : pair_cutoffs) << std::endl
+                      << "隣接原子の距離順の並べ替え: " << NL_sort_by_distance << std::endl
+                      << "隣接リストの投機的な再構築: " << NL_speculative << "（追加のマージン: " << NL_speculative_extra << " Å、開始する割合: " << NL_speculative_trigger << "）" << std::endl
+                      << "熱浴の種類: " << thermostat_type << std::endl;
+
+            //モデルの最適化・int8量子化（設定を反映した隣接リストで、前後の推論時間を計測する）
+            //量子化はfreezeを含むため、optimize_for_inferenceによる最適化とは併用しない
+            if (model_quantize) {
+                md.quantize_model();
+            }
+            else if (model_optimize) {
+                md.optimize_model(model_cache_dir);
+            }
 
-        if (thermostat_type == "Bussi") {
-            const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : 1.0;
-            BussiThermostat thermostat(0.0, tau, device);
+            //最初の隣接リストの構築とウォームアップ（モデルを置き換えた後に行う）
+            md.warm_up(warmup_steps);
 
-            execute_command(commands, md, thermostat, dt);
-        }
+            std::cout << "=====出力設定=====" << std::endl
+                      << "トラジェクトリの保存先: " << trajectory_path << std::endl;
 
-        if (thermostat_type == "NoseHoover") {
-            const IntType chain_length = variables.count("chain_length") ? std::stoi(variables.at("chain_length")) : 1;
-            const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : dt * 1e+3;
-            NoseHooverThermostat thermostat(chain_length, 0.0, tau, device);
+            if (thermostat_type == "Bussi") {
+                const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : 1.0;
+                BussiThermostat thermostat(0.0, tau, device);
 
-            execute_command(commands, md, thermostat, dt);
+                execute_command(commands, md, thermostat, dt);
+            }
+
+            if (thermostat_type == "NoseHoover") {
+                const IntType chain_length = variables.count("chain_length") ? std::stoi(variables.at("chain_length")) : 1;
+                const RealType tau = variables.count("tau") ? std::stod(variables.at("tau")) : dt * 1e+3;
+                NoseHooverThermostat thermostat(chain_length, 0.0, tau, device);
+
+                execute_command(commands, md, thermostat, dt);
+            }
         }
     }
 
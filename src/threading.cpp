@@ -0,0 +1,203 @@
+#include "threading.hpp"
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <ATen/Parallel.h>
+#include <torch/torch.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    //CPUの番号のリストを"0-3,8"のような範囲の表記にする
+    std::string format_list(const std::vector<int>& values){
+        std::stringstream ss;
+        for(size_t i = 0; i < values.size(); ){
+            size_t j = i;
+            while(j + 1 < values.size() && values[j + 1] == values[j] + 1){
+                j++;
+            }
+            if(i > 0){
+                ss << ",";
+            }
+            ss << values[i];
+            if(j > i){
+                ss << "-" << values[j];
+            }
+            i = j + 1;
+        }
+        return ss.str();
+    }
+
+#ifdef __linux__
+    //呼び出したスレッドを指定したコアに固定
+    bool pin_current_thread(const std::vector<int>& cpus){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(const int cpu : cpus){
+            CPU_SET(cpu, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+#endif
+}
+
+//CPUの番号のリストの解釈
+std::vector<int> threading::parse_cpu_list(const std::string& spec){
+    std::set<int> cpus;
+    std::stringstream ss(spec);
+    std::string item;
+    while(std::getline(ss, item, ',')){
+        //前後の空白を除去
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if(item.empty()){
+            continue;
+        }
+
+        const auto dash = item.find('-');
+        try{
+            const int first = std::stoi(item.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            if(first < 0 || last < first){
+                throw std::invalid_argument(item);
+            }
+            for(int cpu = first; cpu <= last; cpu++){
+                cpus.insert(cpu);
+            }
+        }
+        catch(const std::exception&){
+            throw std::invalid_argument("CPUの指定が不正です：" + item);
+        }
+    }
+    return std::vector<int>(cpus.begin(), cpus.end());
+}
+
+//CPUが属するNUMAノード
+int threading::numa_node_of_cpu(const int cpu){
+    //sysfsの/sys/devices/system/cpu/cpuN/nodeMから取得
+    std::error_code ec;
+    const std::filesystem::path dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    for(const auto& entry : std::filesystem::directory_iterator(dir, ec)){
+        const std::string name = entry.path().filename().string();
+        if(name.rfind("node", 0) == 0 && name.size() > 4 && std::all_of(name.begin() + 4, name.end(), [](unsigned char c){ return std::isdigit(c); })){
+            return std::stoi(name.substr(4));
+        }
+    }
+    return -1;
+}
+
+//スレッド数・コアの割り当て・メモリ配置の設定
+void threading::configure(const IntType num_threads, const IntType num_interop_threads, const std::string& cpu_list, const bool numa_bind){
+    const std::vector<int> cpus = parse_cpu_list(cpu_list);
+
+    //使用するコアのNUMAノード
+    std::vector<int> nodes;
+    {
+        std::set<int> node_set;
+        for(const int cpu : cpus){
+            const int node = numa_node_of_cpu(cpu);
+            if(node >= 0){
+                node_set.insert(node);
+            }
+        }
+        nodes.assign(node_set.begin(), node_set.end());
+    }
+
+    std::string memory_policy = "既定（first-touch）";
+
+#ifdef __linux__
+    //1. プロセス（メインスレッド）をコアに固定し、以降に作られるスレッドにも引き継がせる
+    if(!cpus.empty()){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(const int cpu : cpus){
+            CPU_SET(cpu, &set);
+        }
+        if(sched_setaffinity(0, sizeof(set), &set) != 0){
+            throw std::runtime_error("CPUの割り当てに失敗しました：" + cpu_list);
+        }
+    }
+
+    //2. メモリの確保先をNUMAノードに限定する
+    //set_mempolicyはスレッドごとの設定のため、ワーカースレッドを作る前に行い、引き継がせる
+    if(numa_bind){
+        if(nodes.empty()){
+            std::cerr << "NUMAノードを取得できなかったため、メモリの確保先は限定しません。" << std::endl;
+        }
+        else{
+            constexpr int MPOL_BIND_MODE = 2;   //numaif.hのMPOL_BIND
+            constexpr unsigned long bits = 8 * sizeof(unsigned long);
+            std::vector<unsigned long> mask(nodes.back() / bits + 1, 0);
+            for(const int node : nodes){
+                mask[node / bits] |= 1UL << (node % bits);
+            }
+            if(syscall(SYS_set_mempolicy, MPOL_BIND_MODE, mask.data(), mask.size() * bits + 1) != 0){
+                std::cerr << "メモリの確保先の設定に失敗しました。既定の配置で続行します。" << std::endl;
+            }
+            else{
+                memory_policy = "NUMAノード " + format_list(nodes) + " に限定";
+            }
+        }
+    }
+#else
+    if(!cpus.empty() || numa_bind){
+        std::cerr << "コアの固定とメモリの配置は、Linux以外では無視されます。" << std::endl;
+    }
+#endif
+
+    //3. スレッド数の設定
+    //inter-opのスレッド数は、inter-opの並列処理が始まる前にしか変更できない
+    if(num_interop_threads > 0){
+        at::set_num_interop_threads(static_cast<int>(num_interop_threads));
+    }
+    if(num_threads > 0){
+        at::set_num_threads(static_cast<int>(num_threads));
+    }
+    else if(!cpus.empty()){
+        at::set_num_threads(static_cast<int>(cpus.size()));
+    }
+    const int intra = at::get_num_threads();
+
+#ifdef __linux__
+    //intra-opのワーカースレッドを1つずつコアに固定する
+    //メインスレッド（0番）は、std::asyncなどで作るスレッドが1つのコアに偏らないよう、コアの集合全体のままにする
+    std::atomic<bool> pinned{true};
+    if(!cpus.empty()){
+        at::parallel_for(0, intra, 1, [&](int64_t, int64_t){
+            const int thread = at::get_thread_num();
+            if(thread == 0){
+                return;
+            }
+            if(!pin_current_thread({cpus[thread % cpus.size()]})){
+                pinned = false;
+            }
+        });
+    }
+#endif
+
+    //設定の出力
+    std::cout << "=====CPUの設定=====" << std::endl
+              << "intra-opのスレッド数: " << intra << std::endl
+              << "inter-opのスレッド数: " << at::get_num_interop_threads() << std::endl
+              << "使用するコア: " << (cpus.empty() ? "指定なし" : format_list(cpus)) << std::endl
+              << "NUMAノード: " << (nodes.empty() ? "不明" : format_list(nodes)) << std::endl
+              << "メモリの確保先: " << memory_policy << std::endl;
+#ifdef __linux__
+    if(!cpus.empty()){
+        std::cout << "ワーカースレッドのコアへの固定: " << (pinned.load() ? "1スレッドずつ" : "一部失敗") << std::endl;
+    }
+#endif
+}